@@ -24,12 +24,21 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/convenience.hpp>
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <map>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include "HcEngine.hpp"
+#include "HcThreadPool.hpp"
 
 #define VERSION "1.0"
 
@@ -64,6 +73,7 @@ static void display_status (HcStatus status)
       CASE (HC_ERROR_BLOCK_SIZE_TOO_BIG,        "Error: Block size too big!\n");
       CASE (HC_ERROR_OUTPUT_FILE_ALREADY_EXISTS,"Error: Output file already exists!\n");
       CASE (HC_ERROR_KEY_FILE_ALREADY_EXISTS,   "Error: Key file already exists!\n");
+      CASE (HC_ERROR_MEMORY_BUDGET_TOO_SMALL,   "Error: Memory budget too small for the key!\n");
       CASE (HC_INTERNAL_ERROR,                  "Error: Internal error!\n");
 
       CASE (HC_STATUS_OK,                    "Success!\n");
@@ -79,6 +89,21 @@ static void display_status (HcStatus status)
    }
 }
 
+// The ciphers of the -c option.
+static const struct
+{
+   const char* m_name;
+   HcCipher m_cipher;
+}
+cipher_names[] =
+{
+   { "aes-256", HC_CIPHER_AES_256_CBC },
+   { "aes-256-ctr", HC_CIPHER_AES_256_CTR },
+   { "aes-256-gcm", HC_CIPHER_AES_256_GCM },
+   { "chacha20", HC_CIPHER_CHACHA20 },
+   { "chacha20-poly1305", HC_CIPHER_CHACHA20_POLY1305 },
+};
+
 static void show_encrypt_syntax (void)
 {
    printf ("\nVersion: " VERSION "\n\n");
@@ -89,6 +114,32 @@ static void show_encrypt_syntax (void)
    printf ("Encrypt and Split Syntax: hypercrypt -e -s <splits> <file>\n");
    printf ("   example: hypercrypt -e -s 3 my_file.txt\n");
    printf ("    output: my_file.txt.hckey my_file.txt.hc my_file.txt.01.hc my_file.txt.02.hc my_file.txt.03.hc\n\n");
+
+   printf ("Threads: hypercrypt -t <threads> -e ... or hypercrypt -t <threads> -d ...\n");
+   printf ("   example: hypercrypt -t 4 -e my_file.txt\n");
+   printf ("   0 uses one thread per CPU core\n\n");
+
+   printf ("I/O: hypercrypt -io <default|mmap|direct> -e ... or hypercrypt -io <default|mmap|direct> -d ...\n");
+   printf ("   example: hypercrypt -t 4 -io mmap -e my_file.txt\n");
+   printf ("   mmap maps the files and reads or writes the segments in place\n");
+   printf ("   direct reads and writes around the system cache, the default from 32 GB up\n\n");
+
+   printf ("Cipher: hypercrypt -c <aes-256|aes-256-ctr|aes-256-gcm|chacha20|chacha20-poly1305> -e ...\n");
+   printf ("   example: hypercrypt -t 4 -c aes-256-gcm -e my_file.txt\n");
+   printf ("   aes-256 is the default; the others encrypt on several threads, gcm and poly1305 catch changed files\n");
+   printf ("   chacha20 is faster without AES instructions\n\n");
+
+   printf ("Split Directories: hypercrypt -dirs <dir>,<dir>... -e -s ... or hypercrypt -dirs <dir>,<dir>... -d -j ...\n");
+   printf ("   example: hypercrypt -t 0 -dirs /mnt/disk1,/mnt/disk2 -e -s 4 my_file.txt\n");
+   printf ("   the parts go to the directories in turn, and are all written or read at once with several threads\n\n");
+
+   printf ("Memory: hypercrypt -mem <MB> -e ... or hypercrypt -mem <MB> -d ...\n");
+   printf ("   example: hypercrypt -t 0 -mem 400 -e my_file.txt\n");
+   printf ("   smaller segments, fewer threads and less buffering keep the memory used within the budget\n\n");
+
+   printf ("Batch Syntax: hypercrypt -e -b <file, directory, @list or pattern>...\n");
+   printf ("   example: hypercrypt -t 0 -e -b my_dir @my_list.txt *.txt\n");
+   printf ("   directories are walked down, lists have a file per line, patterns take * and ?\n\n");
 }
 
 static void show_decrypt_syntax (void)
@@ -100,6 +151,10 @@ static void show_decrypt_syntax (void)
    printf ("Decrypt and Join: hypercrypt -d -j <joins> <key file>\n");
    printf ("   example: hypercrypt -d my_file.txt.hckey\n");
    printf ("   files my_file.txt.01.hc, my_file.txt.02.hc, and my_file.txt.03.hc must be present\n\n");
+
+   printf ("Batch Syntax: hypercrypt -d -b <key file, directory, @list or pattern>...\n");
+   printf ("   example: hypercrypt -t 0 -d -b *.hckey\n");
+   printf ("   the .hckey files of directories are decrypted\n\n");
 }
 
 static void show_syntax (void)
@@ -137,6 +192,272 @@ static void hc_callback (void*, HcStatus status, int status_data)
    }
 }
 
+static bool has_extension (const std::string& name, const char* ext)
+{
+   size_t length = strlen (ext);
+
+   return (name.size () > length) && !name.compare (name.size () - length, length, ext);
+}
+
+// Match a file name against a pattern, where * is any run of characters and ? is any one character.
+static bool match_pattern (const char* pattern, const char* name)
+{
+   if ('*' == *pattern)
+   {
+      return match_pattern (pattern + 1, name) || (*name && match_pattern (pattern, name + 1));
+   }
+
+   if (!*pattern)
+   {
+      return !*name;
+   }
+
+   return *name && (('?' == *pattern) || (*pattern == *name)) && match_pattern (pattern + 1, name + 1);
+}
+
+/*
+   Add the files named by a batch argument: a file, every file under a directory, the files listed one per line in
+   @list, or the files matching a pattern in its directory.  From directories and patterns, decrypting takes the key
+   files, and encrypting leaves out the encrypted and key files.
+*/
+static bool add_batch_files (const std::string& arg, bool decrypt, std::vector<std::string>& files)
+{
+   namespace fs = boost::filesystem;
+
+   boost::system::error_code error;
+   auto wanted = [decrypt] (const std::string& name)
+   {
+      if (decrypt)
+      {
+         return has_extension (name, ".hckey");
+      }
+
+      return !has_extension (name, ".hc") && !has_extension (name, ".hckey");
+   };
+
+   if (('@' == arg[0]) && (arg.size () > 1))
+   {
+      std::ifstream list (arg.substr (1).c_str ());
+      std::string line;
+
+      if (!list)
+      {
+         return false;
+      }
+
+      while (std::getline (list, line))
+      {
+         if (!line.empty () && ('\r' == line[line.size () - 1]))
+         {
+            line.erase (line.size () - 1);
+         }
+
+         if (!line.empty ())
+         {
+            files.push_back (line);
+         }
+      }
+
+      return true;
+   }
+
+   if (std::string::npos != arg.find_first_of ("*?"))
+   {
+      fs::path pattern (arg);
+      fs::path dir = pattern.has_parent_path () ? pattern.parent_path () : fs::path (".");
+      std::string name = pattern.filename ().string ();
+
+      for (fs::directory_iterator it (dir, error), end; !error && (it != end); it.increment (error))
+      {
+         std::string file_name = it->path ().filename ().string ();
+
+         if (fs::is_regular_file (it->status ()) && match_pattern (name.c_str (), file_name.c_str ()) && wanted (file_name))
+         {
+            files.push_back (pattern.has_parent_path () ? it->path ().string () : file_name);
+         }
+      }
+
+      return !error;
+   }
+
+   if (fs::is_directory (arg, error))
+   {
+      for (fs::recursive_directory_iterator it (arg, error), end; !error && (it != end); it.increment (error))
+      {
+         if (fs::is_regular_file (it->status ()) && wanted (it->path ().filename ().string ()))
+         {
+            files.push_back (it->path ().string ());
+         }
+      }
+
+      return !error;
+   }
+
+   files.push_back (arg);
+
+   return true;
+}
+
+/*
+   Encrypt or decrypt every file named from argv[arg_index] on, with no splits or joins.  The files are tasks of one
+   pool, which the engines share, so small files and the segments of big ones keep the same threads busy.  The big
+   files go first, so they are not left for the end.  The outputs go next to the inputs, and nothing is started if two
+   inputs would write the same output, or if no file is found.
+*/
+static int run_batch (int argc, char* argv[], int arg_index, bool decrypt, unsigned int threads, HcIoMode io_mode,
+                      HcCipher cipher, long memory)
+{
+   std::vector<std::string> names;
+
+   if (arg_index >= argc)
+   {
+      decrypt ? show_decrypt_syntax () : show_encrypt_syntax ();
+      return -1;
+   }
+
+   for (; arg_index < argc; ++arg_index)
+   {
+      if (!add_batch_files (argv[arg_index], decrypt, names))
+      {
+         printf ("Cannot read %s!\n", argv[arg_index]);
+         return -1;
+      }
+   }
+
+   if (names.empty ())
+   {
+      printf ("No files to %s!\n", decrypt ? "decrypt" : "encrypt");
+      return -1;
+   }
+
+   // The size of what each file has to encrypt or decrypt, which is the encrypted file when decrypting.
+   std::vector<std::pair<uintmax_t, std::string> > files;
+
+   // The input that writes each output, by the full name of the output without its extension.
+   std::map<std::string, std::string> outputs;
+
+   for (auto& name : names)
+   {
+      boost::system::error_code error;
+      boost::filesystem::path path (name);
+      boost::filesystem::path dir = path.has_parent_path () ? path.parent_path () : boost::filesystem::path (".");
+      boost::filesystem::path full_dir = boost::filesystem::canonical (dir, error);
+      std::string data_name = name;
+      std::string output;
+
+      if (error)
+      {
+         full_dir = boost::filesystem::absolute (dir);
+      }
+
+      if (decrypt)
+      {
+         output = (full_dir / boost::filesystem::basename (path)).string ();
+         data_name = (dir / (boost::filesystem::basename (path) + ".hc")).string ();
+      }
+      else
+      {
+         output = (full_dir / path.filename ()).string ();
+      }
+
+      auto found = outputs.find (output);
+
+      if (found != outputs.end ())
+      {
+         printf ("%s and %s would both write %s!\n", found->second.c_str (), name.c_str (), output.c_str ());
+         return -1;
+      }
+
+      outputs[output] = name;
+
+      uintmax_t size = boost::filesystem::file_size (data_name, error);
+
+      files.push_back (std::make_pair (error ? 0 : size, name));
+   }
+
+   std::stable_sort (files.begin (), files.end (), [] (const std::pair<uintmax_t, std::string>& a, const std::pair<uintmax_t, std::string>& b)
+   {
+      return a.first > b.first;
+   });
+
+   if (!threads)
+   {
+      threads = std::thread::hardware_concurrency ();
+   }
+
+   HcThreadPool pool;
+
+   if (!pool.setThreads (threads ? threads : 1))
+   {
+      printf ("Cannot start the threads!\n");
+      return -1;
+   }
+
+   // The engines are kept for the next files once they are done with one.
+   std::vector<HcEngine*> engines;
+   std::mutex mutex;
+   std::atomic<size_t> next (0);
+   size_t failed = 0;
+
+   pool.run ((unsigned int) files.size (), [&] (unsigned int)
+   {
+      const std::string& name = files[next++].second;
+      HcEngine* engine = 0;
+
+      {
+         std::lock_guard<std::mutex> lock (mutex);
+
+         if (!engines.empty ())
+         {
+            engine = engines.back ();
+            engines.pop_back ();
+         }
+      }
+
+      if (!engine && (engine = HcEngine::create ()))
+      {
+         engine->setThreadPool (&pool);
+         engine->setIoMode (io_mode);
+         engine->setCipher (cipher);
+
+         // Up to one engine per thread runs at a time, so they share the memory budget.
+         engine->setMemoryBudget ((unsigned long) (memory ? std::max (memory / (long) std::max (threads, 1u), 1L) : 0));
+      }
+
+      HcStatus status = HC_INTERNAL_ERROR;
+
+      if (engine)
+      {
+         engine->setOutputDirectory (boost::filesystem::path (name).parent_path ().string ().c_str ());
+         status = decrypt ? engine->decryptFile (0, name.c_str (), 0, 0) : engine->encryptFile (0, name.c_str (), 0, 0);
+      }
+
+      std::lock_guard<std::mutex> lock (mutex);
+
+      printf ("%s: ", name.c_str ());
+      display_status (status);
+
+      if (HC_STATUS_OK != status)
+      {
+         ++failed;
+      }
+
+      if (engine)
+      {
+         engines.push_back (engine);
+      }
+   });
+
+   for (auto& e : engines)
+   {
+      HcEngine::destroy (e);
+   }
+
+   printf ("%u of %u files done.\n", (unsigned int) (files.size () - failed), (unsigned int) files.size ());
+
+   return failed ? -1 : 0;
+}
+
 // TODO:  Check the integrity of the input params.  Probably use boost to handle the options passed in.
 // TODO:  Check key version.
 int main (int argc, char* argv[])
@@ -157,6 +478,123 @@ int main (int argc, char* argv[])
 
    int result = -1;
    int arg_index = 1;
+   int threads = 1;
+   HcIoMode io_mode = HC_IO_DEFAULT;
+   HcCipher cipher = HC_CIPHER_AES_256_CBC;
+   long memory = 0;
+
+   // The threads, I/O, cipher, split directories and memory options come before the encrypt or decrypt options.
+   while (!std::string (argv[arg_index]).compare ("-t") || !std::string (argv[arg_index]).compare ("-io") ||
+          !std::string (argv[arg_index]).compare ("-c") || !std::string (argv[arg_index]).compare ("-dirs") ||
+          !std::string (argv[arg_index]).compare ("-mem"))
+   {
+      std::string opt = argv[arg_index++];
+
+      if (argc < arg_index + 3)
+      {
+         show_syntax ();
+         HcEngine::destroy (engine);
+         return -1;
+      }
+
+      if (!opt.compare ("-t"))
+      {
+         threads = atoi (argv[arg_index++]);
+
+         if ((threads < 0) || (threads > 64) || !engine->setThreads (threads))
+         {
+            printf ("Threads should be between 0 and 64.\n");
+            HcEngine::destroy (engine);
+            return -1;
+         }
+      }
+      else if (!opt.compare ("-c"))
+      {
+         opt = argv[arg_index++];
+
+         size_t i = 0;
+
+         while ((i < sizeof (cipher_names) / sizeof (cipher_names[0])) && opt.compare (cipher_names[i].m_name))
+         {
+            ++i;
+         }
+
+         if ((i == sizeof (cipher_names) / sizeof (cipher_names[0])) || !engine->setCipher (cipher_names[i].m_cipher))
+         {
+            printf ("Cipher should be aes-256, aes-256-ctr, aes-256-gcm, chacha20 or chacha20-poly1305.\n");
+            HcEngine::destroy (engine);
+            return -1;
+         }
+
+         cipher = cipher_names[i].m_cipher;
+      }
+      else if (!opt.compare ("-mem"))
+      {
+         memory = atol (argv[arg_index++]);
+
+         if ((memory <= 0) || !engine->setMemoryBudget ((unsigned long) memory))
+         {
+            printf ("Memory should be a number of MB.\n");
+            HcEngine::destroy (engine);
+            return -1;
+         }
+      }
+      else if (!opt.compare ("-dirs"))
+      {
+         std::vector<std::string> dirs;
+         std::vector<const char*> dir_names;
+         std::string list = argv[arg_index++];
+
+         for (size_t start = 0, end; start <= list.size (); start = end + 1)
+         {
+            end = list.find (',', start);
+
+            if (std::string::npos == end)
+            {
+               end = list.size ();
+            }
+
+            dirs.push_back (list.substr (start, end - start));
+         }
+
+         for (auto& d : dirs)
+         {
+            dir_names.push_back (d.c_str ());
+         }
+
+         if (!engine->setSplitDirectories ((unsigned long) dir_names.size (), &dir_names[0]))
+         {
+            printf ("Directories should be separated by commas.\n");
+            HcEngine::destroy (engine);
+            return -1;
+         }
+      }
+      else
+      {
+         opt = argv[arg_index++];
+
+         if (!opt.compare ("default"))
+         {
+            io_mode = HC_IO_DEFAULT;
+         }
+         else if (!opt.compare ("mmap"))
+         {
+            io_mode = HC_IO_MMAP;
+         }
+         else if (!opt.compare ("direct"))
+         {
+            io_mode = HC_IO_DIRECT;
+         }
+         else
+         {
+            printf ("I/O should be default, mmap or direct.\n");
+            HcEngine::destroy (engine);
+            return -1;
+         }
+
+         engine->setIoMode (io_mode);
+      }
+   }
 
    while (engine)
    {
@@ -167,9 +605,15 @@ int main (int argc, char* argv[])
          int splits = 0;
          opt = argv[arg_index];
 
+         if (!opt.compare ("-b"))
+         {
+            result = run_batch (argc, argv, arg_index + 1, false, threads, io_mode, cipher, memory);
+            break;
+         }
+
          if (!opt.compare ("-s"))
          {
-            if (argc != 5)
+            if (argc != arg_index + 3)
             {
                show_encrypt_syntax ();
                break;
@@ -201,9 +645,15 @@ int main (int argc, char* argv[])
          int joins = 0;
          opt = argv[arg_index];
 
+         if (!opt.compare ("-b"))
+         {
+            result = run_batch (argc, argv, arg_index + 1, true, threads, io_mode, cipher, memory);
+            break;
+         }
+
          if (!opt.compare ("-j"))
          {
-            if (argc != 5)
+            if (argc != arg_index + 3)
             {
                show_decrypt_syntax ();
                break;
@@ -0,0 +1,316 @@
+/*
+   The MIT License(MIT)
+
+   Copyright(c) 2015 Jamal Benbrahim
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files(the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and / or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions :
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+*/
+
+#include "HcDirectFile.hpp"
+
+#include <string.h>
+#include <stdlib.h>
+
+#include <algorithm>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#include <malloc.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// The aligned buffer of each thread, allocated by its first direct transfer.
+struct DirectBuffer
+{
+   DirectBuffer (void) : m_data (0) {}
+
+   ~DirectBuffer (void)
+   {
+#ifdef _WIN32
+      _aligned_free (m_data);
+#else
+      free (m_data);
+#endif
+   }
+
+   uint8_t* m_data;
+};
+
+static thread_local DirectBuffer t_buffer;
+
+static uint8_t* get_direct_buffer (void)
+{
+   if (!t_buffer.m_data)
+   {
+#ifdef _WIN32
+      t_buffer.m_data = (uint8_t*) _aligned_malloc (DIRECT_IO_SIZE, DIRECT_IO_ALIGNMENT);
+#else
+      void* data = 0;
+
+      if (!posix_memalign (&data, DIRECT_IO_ALIGNMENT, DIRECT_IO_SIZE))
+      {
+         t_buffer.m_data = (uint8_t*) data;
+      }
+#endif
+   }
+
+   return t_buffer.m_data;
+}
+
+// Read up to size bytes at offset, fewer at the end of the file.  Return the bytes read, or -1.
+static int64_t read_at (intptr_t handle, uint8_t* buffer, size_t size, uint64_t offset)
+{
+#ifdef _WIN32
+   OVERLAPPED overlapped;
+   DWORD done = 0;
+
+   memset (&overlapped, 0, sizeof (overlapped));
+   overlapped.Offset = (DWORD) offset;
+   overlapped.OffsetHigh = (DWORD) (offset >> 32);
+
+   if (!ReadFile ((HANDLE) handle, buffer, (DWORD) size, &done, &overlapped) && (ERROR_HANDLE_EOF != GetLastError ()))
+   {
+      return -1;
+   }
+
+   return done;
+#else
+   ssize_t done;
+
+   do
+   {
+      done = pread ((int) handle, buffer, size, (off_t) offset);
+   }
+   while ((done < 0) && (EINTR == errno));
+
+   return done;
+#endif
+}
+
+static bool write_at (intptr_t handle, const uint8_t* buffer, size_t size, uint64_t offset)
+{
+   while (size)
+   {
+#ifdef _WIN32
+      OVERLAPPED overlapped;
+      DWORD done = 0;
+
+      memset (&overlapped, 0, sizeof (overlapped));
+      overlapped.Offset = (DWORD) offset;
+      overlapped.OffsetHigh = (DWORD) (offset >> 32);
+
+      if (!WriteFile ((HANDLE) handle, buffer, (DWORD) size, &done, &overlapped) || !done)
+      {
+         return false;
+      }
+#else
+      ssize_t done = pwrite ((int) handle, buffer, size, (off_t) offset);
+
+      if (done <= 0)
+      {
+         if ((done < 0) && (EINTR == errno))
+         {
+            continue;
+         }
+
+         return false;
+      }
+#endif
+
+      buffer += done;
+      size -= (size_t) done;
+      offset += (uint64_t) done;
+   }
+
+   return true;
+}
+
+// The cached handle of a FILE, for the parts of blocks.
+static intptr_t file_handle (FILE* file)
+{
+#ifdef _WIN32
+   return (intptr_t) _get_osfhandle (_fileno (file));
+#else
+   return fileno (file);
+#endif
+}
+
+HcDirectFile::HcDirectFile (void)
+{
+   m_file = 0;
+   m_handle = -1;
+}
+
+// Open path, which file already has open, around the cache.  This fails where the file system cannot do it.
+bool HcDirectFile::open (FILE* file, const char* path, bool write)
+{
+   close ();
+
+   if (!file || !path)
+   {
+      return false;
+   }
+
+#ifdef _WIN32
+   HANDLE handle = CreateFileA (path, write ? GENERIC_WRITE : GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                                0, OPEN_EXISTING, FILE_FLAG_NO_BUFFERING | (write ? FILE_FLAG_WRITE_THROUGH : 0), 0);
+
+   if (INVALID_HANDLE_VALUE == handle)
+   {
+      return false;
+   }
+
+   m_handle = (intptr_t) handle;
+#elif defined (O_DIRECT)
+   int fd = ::open (path, (write ? O_WRONLY : O_RDONLY) | O_DIRECT);
+
+   if (fd < 0)
+   {
+      return false;
+   }
+
+   m_handle = fd;
+#elif defined (F_NOCACHE)
+   int fd = ::open (path, write ? O_WRONLY : O_RDONLY);
+
+   if (fd < 0)
+   {
+      return false;
+   }
+
+   if (fcntl (fd, F_NOCACHE, 1))
+   {
+      ::close (fd);
+      return false;
+   }
+
+   m_handle = fd;
+#else
+   return false;
+#endif
+
+   m_file = file;
+
+   return true;
+}
+
+void HcDirectFile::close (void)
+{
+   if (-1 != m_handle)
+   {
+#ifdef _WIN32
+      CloseHandle ((HANDLE) m_handle);
+#else
+      ::close ((int) m_handle);
+#endif
+   }
+
+   m_file = 0;
+   m_handle = -1;
+}
+
+bool HcDirectFile::isOpen (void)
+{
+   return -1 != m_handle;
+}
+
+// Read or write size bytes at offset of the file.
+bool HcDirectFile::transfer (uint8_t* buffer, size_t size, uint64_t offset, bool write)
+{
+   uint8_t* aligned = get_direct_buffer ();
+
+   if (!isOpen () || !aligned)
+   {
+      return false;
+   }
+
+   if (!write)
+   {
+      // The blocks around the bytes are read, up to the end of the file.
+      while (size)
+      {
+         uint64_t start = offset & ~((uint64_t) DIRECT_IO_ALIGNMENT - 1);
+         size_t skip = (size_t) (offset - start);
+         size_t want = DIRECT_IO_SIZE;
+
+         if (skip + size < want)
+         {
+            want = (skip + size + DIRECT_IO_ALIGNMENT - 1) & ~((size_t) DIRECT_IO_ALIGNMENT - 1);
+         }
+
+         int64_t done = read_at (m_handle, aligned, want, start);
+
+         if (done <= (int64_t) skip)
+         {
+            return false;
+         }
+
+         size_t part = (size_t) done - skip;
+
+         if (part > size)
+         {
+            part = size;
+         }
+
+         memcpy (buffer, aligned + skip, part);
+
+         buffer += part;
+         size -= part;
+         offset += part;
+      }
+
+      return true;
+   }
+
+   uint64_t end = offset + size;
+   uint64_t first = (offset + DIRECT_IO_ALIGNMENT - 1) & ~((uint64_t) DIRECT_IO_ALIGNMENT - 1);
+   uint64_t last = end & ~((uint64_t) DIRECT_IO_ALIGNMENT - 1);
+
+   // Without a whole block, the bytes all go through the cache.
+   if (first >= last)
+   {
+      return write_at (file_handle (m_file), buffer, size, offset);
+   }
+
+   if (!write_at (file_handle (m_file), buffer, (size_t) (first - offset), offset) ||
+       !write_at (file_handle (m_file), buffer + (last - offset), (size_t) (end - last), last))
+   {
+      return false;
+   }
+
+   for (uint64_t pos = first; pos < last; )
+   {
+      size_t part = (size_t) std::min ((uint64_t) DIRECT_IO_SIZE, last - pos);
+
+      memcpy (aligned, buffer + (pos - offset), part);
+
+      if (!write_at (m_handle, aligned, part, pos))
+      {
+         return false;
+      }
+
+      pos += part;
+   }
+
+   return true;
+}
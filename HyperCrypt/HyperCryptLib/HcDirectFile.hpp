@@ -0,0 +1,58 @@
+/*
+   The MIT License(MIT)
+
+   Copyright(c) 2015 Jamal Benbrahim
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files(the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and / or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions :
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+*/
+
+#ifndef __HCDIRECTFILE_HPP__
+#define __HCDIRECTFILE_HPP__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+// Direct transfers are aligned to this many bytes, and go through an aligned buffer of up to this many bytes.
+#define DIRECT_IO_ALIGNMENT 4096
+#define DIRECT_IO_SIZE      (8 * 1024 * 1024)
+
+/*
+   A second handle to an open file that reads and writes it around the system cache.  The whole blocks of a transfer
+   go through an aligned buffer of the calling thread.  The parts of blocks at the ends of a write go through the
+   open file instead, so threads writing next to each other never share a direct block.  Like the FILE it goes with,
+   it is closed explicitly, and copying it does not open the file again.
+*/
+class HcDirectFile
+{
+   public:
+      HcDirectFile (void);
+
+      bool open (FILE* file, const char* path, bool write);
+      void close (void);
+      bool isOpen (void);
+
+      bool transfer (uint8_t* buffer, size_t size, uint64_t offset, bool write);
+
+   private:
+      FILE* m_file;
+      intptr_t m_handle;
+};
+
+#endif
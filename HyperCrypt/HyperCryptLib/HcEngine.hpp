@@ -54,6 +54,9 @@ enum HcStatus
    HC_ERROR_KEY_FILE_ALREADY_EXISTS,
    HC_INTERNAL_ERROR,
 
+   // New errors go here, so the values of the ones above never change.
+   HC_ERROR_MEMORY_BUDGET_TOO_SMALL,
+
    HC_STATUS_OK = 0,
    HC_STATUS_KEY_CREATION_START,
    HC_STATUS_KEY_CREATION_PROGRESS,
@@ -75,8 +78,50 @@ enum HcStatus
    HC_STATUS_DONE,
 };
 
+// How a file is divided into segments when it is encrypted.  Any of them can be decrypted the same way.
+enum HcSegmentSizing
+{
+   HC_SEGMENT_SIZING_DEFAULT = 0,   // Segments as big as possible, up to the max block size, and at least 3 of them.
+   HC_SEGMENT_SIZING_CACHE,         // Segments no bigger than param bytes (4K and up), or the L2 cache if 0, so the shuffle stays in cache.
+   HC_SEGMENT_SIZING_THREADS,       // At least param segments, or one per CPU core if 0, or as many as there can be.
+};
+
+// How the bytes of a segment are shuffled when it is encrypted.  The key records it, so any of them can be decrypted.
+enum HcShuffle
+{
+   HC_SHUFFLE_LFSR = 0,             // One LFSR over the whole segment (version 1 keys).  The default.
+   HC_SHUFFLE_TWO_LEVEL,            // One LFSR picks a 4K block, another shuffles the bytes in it, so the scatter stays in cache (version 2 keys).
+   HC_SHUFFLE_FEISTEL,              // A keyed Feistel permutation, which can start anywhere in a segment (version 3 keys).
+};
+
+// The cipher the segments are encrypted with.  The key records it, so any of them can be decrypted.
+enum HcCipher
+{
+   HC_CIPHER_AES_256_CBC = 0,       // The IV is chained over the segment; it can only be split over threads to decrypt.
+   HC_CIPHER_AES_256_CTR,           // Can be split over threads both ways (version 4 keys).
+   HC_CIPHER_AES_256_GCM,           // Also keeps a tag per segment, so corruption is caught when decrypting (version 4 keys).
+   HC_CIPHER_CHACHA20,              // Like CTR, but fast without AES instructions.  Needs OpenSSL 1.1.0 (version 4 keys).
+   HC_CIPHER_CHACHA20_POLY1305,     // ChaCha20 with a tag per segment, like GCM.  Needs OpenSSL 1.1.0 (version 4 keys).
+};
+
+// How the files are read and written.
+enum HcIoMode
+{
+   HC_IO_DEFAULT = 0,               // Read ahead and written behind, or at their offsets by several threads.
+   HC_IO_MMAP,                      // Mapped, so the segments are scattered into and gathered from the files themselves.
+   HC_IO_DIRECT,                    // Around the system cache, in aligned blocks.  The default for very large files.
+};
+
+class HcThreadPool;
+
 typedef void (*HcEngineCallback)(void* context, HcStatus status, int status_data);
 
+/*
+   An engine keeps all of its state to itself, so several engines can run at the same time, each one used by a
+   single thread at a time.  One engine must not be used by several threads at the same time.  With more than one
+   thread, the callback may be called on the worker threads instead of the one that called encryptFile or
+   decryptFile, but only by one thread at a time.
+*/
 class HcEngine
 {
    public:
@@ -86,6 +131,36 @@ class HcEngine
       virtual unsigned long getMinBlockSize (void) = 0;
       virtual unsigned long getMaxBlockSize (void) = 0;
 
+      virtual bool setSegmentSizing (HcSegmentSizing sizing, unsigned long param) = 0;
+      virtual bool setShuffle (HcShuffle shuffle) = 0;
+
+      // The number of threads used to encrypt or decrypt, or 0 for one per CPU core.  The segments are spread over the
+      // threads, and the large ones are split between them when their cipher allows it.  The default is 1.
+      virtual bool setThreads (unsigned long threads) = 0;
+
+      // Use the threads of a pool shared by several engines instead, so files encrypted or decrypted at the same time
+      // keep the same threads busy.  The pool must outlive its use; 0 goes back to the engine's own threads.
+      virtual bool setThreadPool (HcThreadPool* pool) = 0;
+
+      virtual bool setCipher (HcCipher cipher) = 0;
+
+      // Files that cannot be mapped, or read and written around the cache, are read and written the default way.
+      virtual bool setIoMode (HcIoMode mode) = 0;
+
+      // The parts of a split file go to, and are read back from, these directories in turn, so they can be on
+      // different disks.  With several threads, all the parts are written or read at once.  0 directories is the
+      // current one.
+      virtual bool setSplitDirectories (unsigned long count, const char* const* directories) = 0;
+
+      // Write the outputs to this directory instead of the current one, and read the encrypted files to decrypt from
+      // it too.  0 or an empty name goes back to the current directory.
+      virtual bool setOutputDirectory (const char* directory) = 0;
+
+      // Hold the memory of encryptFile and decryptFile to about this many MB, or 0 for no limit.  New segments are
+      // made smaller, and fewer segments are done at once with less reading ahead and writing behind, to fit.  A key
+      // with a segment too big to decrypt within the budget fails with HC_ERROR_MEMORY_BUDGET_TOO_SMALL up front.
+      virtual bool setMemoryBudget (unsigned long megabytes) = 0;
+
       virtual HcStatus encryptFile (unsigned long splits, const char* file_path, HcEngineCallback callback, void* context) = 0;
       virtual HcStatus decryptFile (unsigned long joins, const char* key_file_path, HcEngineCallback callback, void* context) = 0;
 
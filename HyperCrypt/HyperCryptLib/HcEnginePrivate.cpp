@@ -22,8 +22,15 @@
    THE SOFTWARE.
 */
 
+#include "HcDirectFile.hpp"
 #include "HcEngine.hpp"
+#include "HcFileMap.hpp"
 #include "HcLfsr.hpp"
+#include "HcMultiCbc.hpp"
+#include "HcShuffler.hpp"
+#include "HcStage.hpp"
+#include "HcThreadPool.hpp"
+#include "HcUring.hpp"
 
 #include <stdint.h>
 #include <vector>
@@ -31,14 +38,28 @@
 #include <random>
 #include <queue>
 #include <iostream>
+#include <mutex>
+#include <thread>
 #include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <errno.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
 
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/convenience.hpp>
 #include <boost/property_tree/ptree.hpp>
 #include <boost/property_tree/xml_parser.hpp>
 
-#include "openssl/aes.h"
+#include "openssl/crypto.h"
+#include "openssl/evp.h"
 #include "openssl/rand.h"
 
 enum HcInternalError
@@ -54,24 +75,195 @@ enum HcInternalError
    HC_INTERNAL_ERROR_CANNOT_STAT_INPUT_FILE,
    HC_INTERNAL_ERROR_CANNOT_SET_LFSR_SPEC,
    HC_INTERNAL_ERROR_CANNOT_RESET_LFSR,
+   HC_INTERNAL_ERROR_CANNOT_INIT_CIPHER,
 };
 
-#define KEY_VERSION   0x00010000
-#define CRYPTO_SCHEME "AES-256"
+// Version 1 keys only use the single-level shuffle.  Version 2 keys add the two-level shuffle, version 3 the Feistel one,
+// version 4 the schemes other than CBC.  The two-level shuffle is faster but weaker, since the byte permutations of its
+// 4K windows are all rotations of one; see HcTwoLevelShuffler.
+#define KEY_VERSION_1 0x00010000
+#define KEY_VERSION_2 0x00020000
+#define KEY_VERSION_3 0x00030000
+#define KEY_VERSION_4 0x00040000
+#define KEY_VERSION   KEY_VERSION_4
+
+// The IV and tag sizes of the AEAD schemes, GCM and ChaCha20-Poly1305.
+#define GCM_IV_SIZE  12
+#define GCM_TAG_SIZE 16
+
+// ChaCha20 came with OpenSSL 1.1.0.
+#if (OPENSSL_VERSION_NUMBER >= 0x10100000L) && !defined(OPENSSL_NO_CHACHA)
+#define HC_HAVE_CHACHA20
+#endif
+
+// The segments are encrypted this many bytes at a time, a multiple of CHUNK_SIZE.
+#define CRYPTO_RUN_SIZE (CHUNK_SIZE * 256)
+
+// The chunks are gathered this many bytes at a time, so they are still in L1 when they are decrypted.
+#define GATHER_SIZE (CHUNK_SIZE * 16)
+
+// The decrypted runs are staged up to this many bytes before they are written out.
+#define OUTPUT_STAGING_SIZE (CRYPTO_RUN_SIZE * 64)
+
+// The segment buffer may grow up to this many bytes so small CBC segments can be encrypted together.
+#define MULTI_CBC_BUFFER_SIZE (64 * 1024 * 1024)
+
+// With one thread, the input is read ahead this many blocks of this many bytes while the segments are shuffled.
+#define READ_AHEAD_BLOCKS     16
+#define READ_AHEAD_BLOCK_SIZE (1024 * 1024)
+
+// Joined parts are each read ahead at least this many bytes, or their biggest segment, so a part is read while the
+// segments of the others are decrypted.
+#define PART_READ_AHEAD_SIZE (64 * 1024 * 1024)
+
+// The output is written behind from a second buffer, when the output buffer is no bigger than this many bytes.
+#define WRITE_BEHIND_SIZE (64 * 1024 * 1024)
+
+// The requests the io_uring has room for.  Its groups are the read ahead blocks, then the two output buffers.
+#define URING_ENTRIES     64
+#define URING_WRITE_GROUP READ_AHEAD_BLOCKS
+
+// Within a memory budget, the engine is taken to need this many bytes besides its segment and I/O buffers, and new
+// segments are made smaller down to this many bytes before fewer of them are done at once.
+#define MEMORY_OVERHEAD     (8 * 1024 * 1024)
+#define BUDGET_SEGMENT_SIZE (16 * 1024 * 1024)
+
+// The smallest segment size the cache sizing policy can be given.
+#define MIN_CACHE_SEGMENT_SIZE (4 * 1024)
+
+// In the default I/O mode, inputs of this many bytes and up are read and written around the system cache.
+#define DIRECT_IO_THRESHOLD ((uint64_t) 32 * 1024 * 1024 * 1024)
 
 struct HcKeyData
 {
+   uint32_t m_shuffle;
    uint64_t m_lfsr_specs;
+   uint64_t m_block_lfsr_specs;
+   uint8_t  m_shuffle_key[FEISTEL_KEY_SIZE];
    uint32_t m_in_size;
    uint32_t m_out_size;
+   uint32_t m_cipher;
    uint8_t  m_iv[16];
    uint8_t  m_key[256 / 8];
+   uint8_t  m_tag[GCM_TAG_SIZE];
+};
+
+// Seek the IV of a stream scheme to the first block of a chunk.  CTR counts 16-byte blocks as a 128-bit big endian
+// number.  It wraps around like OpenSSL does.
+static bool seek_ctr (const uint8_t* iv, uint32_t chunk, uint8_t* chunk_iv)
+{
+   uint64_t carry = (uint64_t) chunk * (CHUNK_SIZE / 16);
+
+   for (int i = 15; i >= 0; --i)
+   {
+      carry += iv[i];
+      chunk_iv[i] = (uint8_t) carry;
+      carry >>= 8;
+   }
+
+   return true;
+}
+
+// ChaCha20 counts 64-byte blocks in the first 4 bytes of the IV, as a little endian number.  OpenSSL carries a
+// wrapped counter into the nonce, so the counter must not wrap.
+static bool seek_chacha20 (const uint8_t* iv, uint32_t chunk, uint8_t* chunk_iv)
+{
+   uint64_t counter = (uint64_t) iv[0] | ((uint64_t) iv[1] << 8) | ((uint64_t) iv[2] << 16) | ((uint64_t) iv[3] << 24);
+
+   counter += (uint64_t) chunk * (CHUNK_SIZE / 64);
+
+   if (counter > 0xFFFFFFFFull)
+   {
+      return false;
+   }
+
+   memcpy (chunk_iv, iv, 16);
+
+   for (int i = 0; i < 4; ++i)
+   {
+      chunk_iv[i] = (uint8_t) (counter >> (8 * i));
+   }
+
+   return true;
+}
+
+// A cipher scheme of the segments.
+struct HcCipherScheme
+{
+   uint32_t m_cipher;                  // See HcCipher.
+   const char* m_name;                 // The scheme in the key file.
+   uint32_t m_version;                 // The key version it needs.
+   const EVP_CIPHER* (*m_evp) (void);  // Makes the OpenSSL cipher of the encrypt and decrypt contexts.
+   bool m_tag;                         // Keeps a tag per segment, which covers the whole segment.
+   bool m_split_decrypt;               // A range of chunks can be decrypted on its own.
+   bool (*m_seek) (const uint8_t* iv, uint32_t chunk, uint8_t* chunk_iv);  // Seeks the cipher stream, if it can.
+};
+
+// The cipher registry.  New schemes only need an entry here.
+static const HcCipherScheme s_cipher_schemes[] =
+{
+   { HC_CIPHER_AES_256_CBC,       "AES-256",           KEY_VERSION_1, EVP_aes_256_cbc,       false, true,  0 },
+   { HC_CIPHER_AES_256_CTR,       "AES-256-CTR",       KEY_VERSION_4, EVP_aes_256_ctr,       false, true,  seek_ctr },
+   { HC_CIPHER_AES_256_GCM,       "AES-256-GCM",       KEY_VERSION_4, EVP_aes_256_gcm,       true,  false, 0 },
+#ifdef HC_HAVE_CHACHA20
+   { HC_CIPHER_CHACHA20,          "CHACHA20",          KEY_VERSION_4, EVP_chacha20,          false, true,  seek_chacha20 },
+   { HC_CIPHER_CHACHA20_POLY1305, "CHACHA20-POLY1305", KEY_VERSION_4, EVP_chacha20_poly1305, true,  false, 0 },
+#endif
 };
 
-// Convenience macro to call back the user.
+static const HcCipherScheme* find_cipher_scheme (uint32_t cipher)
+{
+   for (size_t i = 0; i < sizeof (s_cipher_schemes) / sizeof (s_cipher_schemes[0]); ++i)
+   {
+      if (s_cipher_schemes[i].m_cipher == cipher)
+      {
+         return &s_cipher_schemes[i];
+      }
+   }
+
+   return 0;
+}
+
+static const HcCipherScheme* find_cipher_scheme (const std::string& name)
+{
+   for (size_t i = 0; i < sizeof (s_cipher_schemes) / sizeof (s_cipher_schemes[0]); ++i)
+   {
+      if (!name.compare (s_cipher_schemes[i].m_name))
+      {
+         return &s_cipher_schemes[i];
+      }
+   }
+
+   return 0;
+}
+
+// Whether the sizes and the scheme of a segment to decrypt make sense.  A seekable cipher stream must reach the end of
+// the segment, or the chunks could not be seeked to.
+static bool check_segment_key (const HcKeyData& key_data)
+{
+   const HcCipherScheme* scheme = find_cipher_scheme (key_data.m_cipher);
+   uint8_t end_iv[sizeof (key_data.m_iv)];
+
+   if (!key_data.m_in_size || (key_data.m_in_size > key_data.m_out_size) || !scheme)
+   {
+      return false;
+   }
+
+   return !scheme->m_seek || scheme->m_seek (key_data.m_iv, key_data.m_out_size / CHUNK_SIZE, end_iv);
+}
+
+// Whether a range of chunks of a segment can be encrypted or decrypted on its own.  Encrypting needs a seekable
+// stream, while decrypting CBC only needs the cipher block before the range.
+static bool can_split (const HcCipherScheme* scheme, int enc)
+{
+   return scheme && (enc ? (0 != scheme->m_seek) : scheme->m_split_decrypt);
+}
+
+// Convenience macro to call back the user.  The threads take turns.
 #define HC_CALLBACK(_status, _status_data)\
    if (m_callback)\
    {\
+      std::lock_guard<std::mutex> callback_lock (m_callback_mutex);\
       try\
       {\
          m_callback (m_callback_context, _status, (int)(_status_data));\
@@ -92,29 +284,106 @@ class HcEnginePrivate : public HcEngine
       virtual unsigned long getMinBlockSize (void);
       virtual unsigned long getMaxBlockSize (void);
 
+      virtual bool setSegmentSizing (HcSegmentSizing sizing, unsigned long param);
+      virtual bool setShuffle (HcShuffle shuffle);
+      virtual bool setThreads (unsigned long threads);
+      virtual bool setThreadPool (HcThreadPool* pool);
+      virtual bool setCipher (HcCipher cipher);
+      virtual bool setIoMode (HcIoMode mode);
+      virtual bool setSplitDirectories (unsigned long count, const char* const* directories);
+      virtual bool setOutputDirectory (const char* directory);
+      virtual bool setMemoryBudget (unsigned long megabytes);
+
       virtual HcStatus encryptFile (unsigned long splits, const char* in_file_path, HcEngineCallback callback, void* context);
       virtual HcStatus decryptFile (unsigned long joins, const char* key_file_path, HcEngineCallback callback, void* context);
 
    private:
       HcEngineCallback m_callback;
       void* m_callback_context;
+      std::mutex m_callback_mutex;
+
+      HcSegmentSizing m_segment_sizing;
+      unsigned long m_segment_sizing_param;
+
+      HcShuffle m_shuffle;
+      HcCipher m_cipher;
+      HcIoMode m_io_mode;
+      std::vector<std::string> m_split_directories;
+      std::string m_output_directory;
+
+      // The memory budget, and how the buffers are held back to fit in it: the mapped files, the segments done side
+      // by side, the parallel path, the read streams of joined parts, the multi-buffer CBC batches, the read ahead and
+      // the write behind.
+      uint64_t m_memory_budget;
+      bool m_budget_map;
+      size_t m_budget_threads;
+      bool m_budget_parallel;
+      bool m_budget_part_streams;
+      bool m_budget_multi_cbc;
+      size_t m_budget_read_ahead;
+      bool m_budget_back_buffer;
 
       HcLfsr* m_lfsr;
 
+      // What one thread needs to shuffle and encrypt or decrypt segments.  They are reused for every segment.
+      struct Worker
+      {
+         Worker (void)
+         {
+            m_cipher_ctx = EVP_CIPHER_CTX_new ();
+         }
+
+         ~Worker (void)
+         {
+            if (m_cipher_ctx)
+            {
+               EVP_CIPHER_CTX_free (m_cipher_ctx);
+            }
+         }
+
+         HcLfsrShuffler m_lfsr_shuffler;
+         HcTwoLevelShuffler m_two_level_shuffler;
+         HcFeistelShuffler m_feistel_shuffler;
+         EVP_CIPHER_CTX* m_cipher_ctx;
+         uint8_t m_gather[GATHER_SIZE];
+
+         // The plain and cipher text of the segment the worker encrypts or decrypts on its own.
+         std::vector<uint8_t> m_plain;
+         std::vector<uint8_t> m_segment;
+      };
+
+      // One worker per thread of the pool, which is the engine's own unless it is shared with other engines.
+      std::vector<Worker*> m_workers;
+      HcThreadPool m_own_pool;
+      HcThreadPool* m_pool;
+
+      // The CBC segments encrypted together, and the shufflers of their lanes.
+      HcMultiCbc m_multi_cbc;
+      std::vector<Worker*> m_lane_workers;
+
       struct FileSpec
       {
          void clear (void)
          {
             m_file_name.clear();
             m_temp_file_name.clear();
+            m_renamed = false;
             m_file = 0;
             m_size = 0;
+            m_map = HcFileMap ();
+            m_direct = HcDirectFile ();
          }
 
          std::string m_file_name;
          std::string m_temp_file_name;
+
+         // Set once the temp file has been renamed, so only a file of this engine is removed if it fails afterwards.
+         bool m_renamed = false;
+
          FILE* m_file;
          size_t m_size;
+         HcFileMap m_map;
+         HcDirectFile m_direct;
       };
 
       std::vector<FileSpec> m_in_files;
@@ -127,19 +396,102 @@ class HcEnginePrivate : public HcEngine
       std::vector<HcKeyData> m_key;
       std::vector<uint8_t> m_buffer;
 
+      // The plain text of the segment when it is decrypted by several threads.
+      std::vector<uint8_t> m_plain_buffer;
+
+      // With one thread, the input is read by the reader stage ahead of the segments, and the output is written by
+      // the writer stage from the back buffer while the next segments go to the other one.  Joined parts each have a
+      // read stream and a reader stage of their own, so they are all read at once.
+      struct ReadBlock
+      {
+         std::vector<uint8_t> m_data;
+         size_t m_size;
+         uint64_t m_ticket;
+      };
+
+      struct ReadStream
+      {
+         HcStage m_reader;
+         std::vector<ReadBlock> m_blocks;
+         size_t m_block;
+         size_t m_offset;
+         uint64_t m_left;
+         uint64_t m_position;
+      };
+
+      std::vector<std::unique_ptr<ReadStream>> m_read_streams;
+      ReadStream* m_read_stream;
+      HcStage m_writer;
+      std::vector<uint8_t> m_back_buffer;
+      uint64_t m_back_ticket;
+
+      // Where it is available, the io_uring does the reading and writing of the stages instead.  It, the direct files
+      // and the read streams of joined parts read and write at the offsets of the input and output files.
+      HcUring m_uring;
+      bool m_direct_io;
+      bool m_transfer_at;
+      uint64_t m_write_position;
+      unsigned int m_uring_write_group;
+
    private:
+      void setWorkers (size_t count);
       void cleanUp (void);
       HcStatus adjustStatus (int status);
 
       bool randFill (void* buffer, size_t size);
       std::string getTempFileName (void);
-
+      std::string getOutputFileName (const std::string& file_name);
+      bool renameTempFile (FileSpec& spec);
+      std::string getSplitFileName (const std::string& file_name, size_t index);
+
+      void getSegmentLimits (int64_t file_size, uint32_t& max_size, size_t& min_count);
+      void resetMemoryBudget (void);
+      uint64_t getMemoryNeed (int enc, uint64_t segment_size, uint64_t total_size, size_t parts);
+      bool fitMemoryBudget (int enc, uint64_t segment_size, uint64_t total_size, size_t parts);
+      bool runsParallel (void);
+      int generateLfsrSpecs (HcKeyData& key_data);
       int generateKey (int64_t file_size);
 
+      HcShuffler* getShuffler (const HcKeyData& key_data, Worker& worker);
+
+      bool initCipher (Worker& worker, const HcKeyData& key_data, const uint8_t* iv, int enc);
+      int finishCipher (Worker& worker, HcKeyData& key_data, int enc);
+
+      int startStages (const std::vector<uint64_t>& in_ends, size_t read_ahead, size_t back_size);
+      void readAhead (ReadStream& stream, size_t index);
+      int readFiles (uint8_t* buffer, size_t size);
+      int readInput (uint8_t* buffer, size_t size);
+      int writeBehind (std::vector<uint8_t>& buffer, size_t size);
+      int waitWrites (void);
+
+      int scatterChunks (HcShuffler* shuffler, const uint8_t* in, uint8_t* ob, uint32_t chunk_count);
+      int scatterEncrypt (Worker& worker, HcShuffler* shuffler, uint8_t* in, uint8_t* ob, uint32_t chunk_count);
+      int encryptChunks (Worker& worker, HcKeyData& key_data, uint8_t* in, uint32_t first_chunk, uint32_t chunk_count, uint8_t* ob);
+      int writeSegment (const uint8_t* ob, size_t size);
       int encryptSegment (HcKeyData& key_data);
+      size_t getMultiCbcBatch (size_t first);
+      int encryptSegments (size_t first, size_t count);
+      int encryptSegmentAt (Worker& worker, HcKeyData& key_data, uint64_t in_offset, uint64_t out_offset, bool split);
       int encryptFile (const char* in_file_path, uint32_t splits);
 
+      int gatherDecrypt (Worker& worker, HcShuffler* shuffler, uint8_t* ib, uint8_t* out, uint32_t chunk_count, size_t out_size);
+      int decryptChunks (Worker& worker, HcKeyData& key_data, uint8_t* ib, uint32_t first_chunk, uint32_t chunk_count, uint8_t* out,
+                         size_t out_size);
       int decryptSegment (HcKeyData& key_data);
+      int decryptSegmentAt (Worker& worker, HcKeyData& key_data, uint64_t in_offset, uint64_t out_offset, bool split);
+
+      bool usesDirectIo (uint64_t in_size);
+      void openDirectFiles (uint64_t in_size);
+      void closeDirectFiles (void);
+      bool mapFiles (void);
+      void unmapFiles (void);
+      uint8_t* mappedAt (std::vector<FileSpec>& files, size_t size, uint64_t offset);
+      bool transferAt (std::vector<FileSpec>& files, uint8_t* buffer, size_t size, uint64_t offset, bool write, int group = -1);
+      size_t fileAt (std::vector<FileSpec>& files, uint64_t offset);
+      int runSegments (unsigned int thread, const std::vector<size_t>& segments, std::atomic<size_t>& next,
+                       const std::vector<uint64_t>& in_offsets, const std::vector<uint64_t>& out_offsets, int enc,
+                       std::atomic<uint64_t>& progress, uint64_t total);
+      int runParallel (int enc);
       int decryptFile (const char* key_file_path, unsigned long joins);
 
       int keyToXmlFile (const char* key_file_path);
@@ -152,16 +504,41 @@ class HcEnginePrivate : public HcEngine
 HcEnginePrivate::HcEnginePrivate (void)
 {
    m_lfsr = 0;
+   m_workers.push_back (new Worker);
+   m_pool = &m_own_pool;
    m_callback = 0;
    m_callback_context = 0;
+   m_segment_sizing = HC_SEGMENT_SIZING_DEFAULT;
+   m_segment_sizing_param = 0;
+   m_shuffle = HC_SHUFFLE_LFSR;
+   m_cipher = HC_CIPHER_AES_256_CBC;
+   m_io_mode = HC_IO_DEFAULT;
+   m_memory_budget = 0;
+   resetMemoryBudget ();
    m_in_file_index = 0;
    m_out_file_index = 0;
+   m_read_stream = 0;
+   m_back_ticket = 0;
+   m_direct_io = false;
+   m_transfer_at = false;
+   m_write_position = 0;
+   m_uring_write_group = 0;
    m_key_file.clear ();
 }
 
 HcEnginePrivate::~HcEnginePrivate (void)
 {
    cleanUp ();
+
+   for (auto& w : m_workers)
+   {
+      delete w;
+   }
+
+   for (auto& w : m_lane_workers)
+   {
+      delete w;
+   }
 }
 
 unsigned long HcEnginePrivate::getMinBlockSize (void)
@@ -174,6 +551,178 @@ unsigned long HcEnginePrivate::getMaxBlockSize (void)
    return HcLfsr::getMaxSize ();
 }
 
+/*
+	Select how files are divided into segments when encrypted:
+
+	sizing - the sizing policy.
+	param - the policy parameter; see HcSegmentSizing.
+*/
+bool HcEnginePrivate::setSegmentSizing (HcSegmentSizing sizing, unsigned long param)
+{
+   switch (sizing)
+   {
+      case HC_SEGMENT_SIZING_DEFAULT:
+      case HC_SEGMENT_SIZING_THREADS:
+         break;
+
+      // Segments much smaller than a page only make the key huge.
+      case HC_SEGMENT_SIZING_CACHE:
+         if (param && (param < MIN_CACHE_SEGMENT_SIZE))
+         {
+            return false;
+         }
+         break;
+
+      default:
+         return false;
+   }
+
+   m_segment_sizing = sizing;
+   m_segment_sizing_param = param;
+
+   return true;
+}
+
+/*
+	Select how the bytes of the segments are shuffled when encrypted:
+
+	shuffle - the shuffle; see HcShuffle.
+*/
+bool HcEnginePrivate::setShuffle (HcShuffle shuffle)
+{
+   switch (shuffle)
+   {
+      case HC_SHUFFLE_LFSR:
+      case HC_SHUFFLE_TWO_LEVEL:
+      case HC_SHUFFLE_FEISTEL:
+         break;
+
+      default:
+         return false;
+   }
+
+   m_shuffle = shuffle;
+
+   return true;
+}
+
+/*
+	Set the number of threads used to decrypt a segment:
+
+	threads - the number of threads, or 0 for one per CPU core.
+*/
+bool HcEnginePrivate::setThreads (unsigned long threads)
+{
+   if (!threads)
+   {
+      threads = std::thread::hardware_concurrency ();
+
+      if (!threads)
+      {
+         threads = 1;
+      }
+   }
+
+   if (!m_own_pool.setThreads ((unsigned int) threads))
+   {
+      return false;
+   }
+
+   m_pool = &m_own_pool;
+   setWorkers (threads);
+
+   return true;
+}
+
+// Use the threads of a pool shared with other engines, or the engine's own ones again if pool is 0.
+bool HcEnginePrivate::setThreadPool (HcThreadPool* pool)
+{
+   m_pool = pool ? pool : &m_own_pool;
+   setWorkers (m_pool->getThreads ());
+
+   return true;
+}
+
+void HcEnginePrivate::setWorkers (size_t count)
+{
+   while (m_workers.size () < count)
+   {
+      m_workers.push_back (new Worker);
+   }
+
+   while (m_workers.size () > count)
+   {
+      delete m_workers.back ();
+      m_workers.pop_back ();
+   }
+}
+
+/*
+	Select the cipher the segments are encrypted with:
+
+	cipher - the cipher; see HcCipher.
+*/
+bool HcEnginePrivate::setCipher (HcCipher cipher)
+{
+   if (!find_cipher_scheme (cipher))
+   {
+      return false;
+   }
+
+   m_cipher = cipher;
+
+   return true;
+}
+
+bool HcEnginePrivate::setIoMode (HcIoMode mode)
+{
+   switch (mode)
+   {
+      case HC_IO_DEFAULT:
+      case HC_IO_MMAP:
+      case HC_IO_DIRECT:
+         m_io_mode = mode;
+         return true;
+
+      default:
+         return false;
+   }
+}
+
+bool HcEnginePrivate::setSplitDirectories (unsigned long count, const char* const* directories)
+{
+   if (count && !directories)
+   {
+      return false;
+   }
+
+   for (unsigned long i = 0; i < count; ++i)
+   {
+      if (!directories[i] || !directories[i][0])
+      {
+         return false;
+      }
+   }
+
+   m_split_directories.assign (directories, directories + count);
+
+   return true;
+}
+
+bool HcEnginePrivate::setOutputDirectory (const char* directory)
+{
+   m_output_directory = directory ? directory : "";
+
+   return true;
+}
+
+bool HcEnginePrivate::setMemoryBudget (unsigned long megabytes)
+{
+   m_memory_budget = (uint64_t) megabytes * 1024 * 1024;
+
+   return true;
+}
+
 /*
 	Encrypt a file:
 
@@ -229,6 +778,7 @@ HcStatus HcEnginePrivate::decryptFile(unsigned long joins, const char* key_file_
    }
 
    uint32_t max_segment_size = 0;
+   uint64_t total_out_size = 0;
 
    for (auto& ke : m_key)
    {
@@ -247,9 +797,7 @@ HcStatus HcEnginePrivate::decryptFile(unsigned long joins, const char* key_file_
          return HC_ERROR_BAD_KEY;
       }
 
-      HcLfsr lfsr (ke.m_out_size);
-
-      if (!lfsr.setSpec (ke.m_lfsr_specs))
+      if (!getShuffler (ke, *m_workers[0]))
       {
          return HC_ERROR_BAD_KEY;
       }
@@ -258,6 +806,20 @@ HcStatus HcEnginePrivate::decryptFile(unsigned long joins, const char* key_file_
       {
          max_segment_size = ke.m_out_size;
       }
+
+      total_out_size += ke.m_out_size;
+   }
+
+   // The memory budget must fit the biggest segment before anything is read.
+   if (!fitMemoryBudget (0, max_segment_size, total_out_size, joins ? joins : 1))
+   {
+      return HC_ERROR_MEMORY_BUDGET_TOO_SMALL;
+   }
+
+   // With several threads or mapped files, the buffers are allocated as the segments need them.
+   if (runsParallel ())
+   {
+      max_segment_size = 0;
    }
 
    try
@@ -273,8 +835,6 @@ HcStatus HcEnginePrivate::decryptFile(unsigned long joins, const char* key_file_
       return HC_ERROR_BLOCK_SIZE_TOO_BIG;
    }
 
-   m_lfsr = new HcLfsr (max_segment_size);
-
    int status = decryptFile (key_file_path, joins);
 
    cleanUp ();
@@ -285,6 +845,23 @@ HcStatus HcEnginePrivate::decryptFile(unsigned long joins, const char* key_file_
 // Clean up the engine.
 void HcEnginePrivate::cleanUp (void)
 {
+   // The stages use the files and buffers, so they are stopped first.
+   m_uring.close ();
+
+   for (auto& stream : m_read_streams)
+   {
+      stream->m_reader.stop ();
+   }
+
+   m_writer.stop ();
+   unmapFiles ();
+   closeDirectFiles ();
+
+   m_read_streams.clear ();
+   m_read_stream = 0;
+   m_back_buffer.clear ();
+   m_back_ticket = 0;
+
    for (auto& e : m_in_files)
    {
       if (e.m_file)
@@ -302,7 +879,7 @@ void HcEnginePrivate::cleanUp (void)
          fclose (e.m_file);
       }
 
-      if (!e.m_file_name.empty())
+      if (e.m_renamed)
       {
          remove (e.m_file_name.c_str ());
       }
@@ -320,7 +897,7 @@ void HcEnginePrivate::cleanUp (void)
       fclose (m_key_file.m_file);
    }
 
-   if (!m_key_file.m_file_name.empty())
+   if (m_key_file.m_renamed)
    {
       remove (m_key_file.m_file_name.c_str ());
    }
@@ -341,6 +918,13 @@ void HcEnginePrivate::cleanUp (void)
    m_key.clear ();
 
    m_buffer.clear ();
+   m_plain_buffer.clear ();
+
+   for (auto& w : m_workers)
+   {
+      w->m_plain.clear ();
+      w->m_segment.clear ();
+   }
 
    m_in_file_index = 0;
    m_out_file_index = 0;
@@ -375,6 +959,7 @@ HcStatus HcEnginePrivate::adjustStatus (int status)
       case HC_ERROR_BLOCK_SIZE_TOO_BIG:
       case HC_ERROR_OUTPUT_FILE_ALREADY_EXISTS:
       case HC_ERROR_KEY_FILE_ALREADY_EXISTS:
+      case HC_ERROR_MEMORY_BUDGET_TOO_SMALL:
 
       case HC_STATUS_OK:
       case HC_STATUS_KEY_CREATION_START:
@@ -407,6 +992,7 @@ HcStatus HcEnginePrivate::adjustStatus (int status)
       case HC_INTERNAL_ERROR_CANNOT_STAT_INPUT_FILE:
       case HC_INTERNAL_ERROR_CANNOT_SET_LFSR_SPEC:
       case HC_INTERNAL_ERROR_CANNOT_RESET_LFSR:
+      case HC_INTERNAL_ERROR_CANNOT_INIT_CIPHER:
          status = HC_INTERNAL_ERROR;
          break;
 
@@ -435,49 +1021,464 @@ std::string HcEnginePrivate::getTempFileName (void)
    return boost::filesystem::unique_path().generic_string();
 }
 
-// Generate an encryption key.
-int HcEnginePrivate::generateKey (int64_t file_size)
+// Get the name of an output file in the output directory, or in the current one if there is none.
+std::string HcEnginePrivate::getOutputFileName (const std::string& file_name)
 {
-   uint32_t min_size = HcLfsr::getMinSize ();
-   uint32_t max_size = HcLfsr::getMaxSize ();
-
-   std::vector<uint32_t> sizes;
+   if (m_output_directory.empty ())
+   {
+      return file_name;
+   }
 
-   int64_t s = file_size;
+   return (boost::filesystem::path (m_output_directory) / file_name).string ();
+}
 
-   // Divide up the total size into segment sizes.
-   while (s && (max_size >= min_size))
+/*
+   Rename a temp file to its final name, unless a file of that name has shown up since it was checked.  A hard link
+   checks and renames in one step, so two engines can never both take the same name; without one, the name is
+   checked again right before the rename.
+*/
+bool HcEnginePrivate::renameTempFile (FileSpec& spec)
+{
+#if !defined(_WIN32)
+   if (0 == link (spec.m_temp_file_name.c_str (), spec.m_file_name.c_str ()))
    {
-      if (s > max_size)
-      {
-         s -= max_size;
-         sizes.push_back (max_size);
-         continue;
-      }
-
-      max_size /= 2;
+      remove (spec.m_temp_file_name.c_str ());
+      spec.m_renamed = true;
+      return true;
    }
 
-   size_t min_key_count = 3;
-
-   if (s)
+   if (EEXIST == errno)
    {
-      --min_key_count;
+      return false;
    }
+#endif
 
-   // Make sure at least 3 keys are used.
-   if (((file_size - s) >= (int64_t)(min_size * min_key_count)) && (sizes.size () < min_key_count))
+   // On Windows, rename fails by itself if the file exists.
+   if (boost::filesystem::exists (spec.m_file_name) || (rename (spec.m_temp_file_name.c_str (), spec.m_file_name.c_str ()) < 0))
    {
-      while (sizes.size () < min_key_count)
+      return false;
+   }
+
+   spec.m_renamed = true;
+
+   return true;
+}
+
+// Get the name of part index of a split file, in its split directory if there are any.
+std::string HcEnginePrivate::getSplitFileName (const std::string& file_name, size_t index)
+{
+   char temp[64];
+
+   sprintf (temp, ".%02d.hc", (int) (index + 1));
+
+   if (m_split_directories.empty ())
+   {
+      return file_name + temp;
+   }
+
+   boost::filesystem::path path (m_split_directories[index % m_split_directories.size ()]);
+
+   return (path / (boost::filesystem::path (file_name).filename ().string () + temp)).string ();
+}
+
+// Get the size of the L2 cache, or 0 if it cannot be found.
+static size_t get_l2_cache_size (void)
+{
+#if defined(_WIN32)
+   DWORD length = 0;
+
+   GetLogicalProcessorInformation (0, &length);
+
+   std::vector<SYSTEM_LOGICAL_PROCESSOR_INFORMATION> info (length / sizeof (SYSTEM_LOGICAL_PROCESSOR_INFORMATION) + 1);
+
+   if (!GetLogicalProcessorInformation (&info[0], &length))
+   {
+      return 0;
+   }
+
+   for (size_t i = 0; i < length / sizeof (SYSTEM_LOGICAL_PROCESSOR_INFORMATION); ++i)
+   {
+      if ((RelationCache == info[i].Relationship) && (2 == info[i].Cache.Level))
+      {
+         return info[i].Cache.Size;
+      }
+   }
+
+   return 0;
+#elif defined(_SC_LEVEL2_CACHE_SIZE)
+   long size = sysconf (_SC_LEVEL2_CACHE_SIZE);
+
+   return (size > 0) ? (size_t) size : 0;
+#else
+   return 0;
+#endif
+}
+
+// Get the biggest segment size and the least number of segments for the sizing policy.
+void HcEnginePrivate::getSegmentLimits (int64_t file_size, uint32_t& max_size, size_t& min_count)
+{
+   max_size = HcLfsr::getMaxSize ();
+   min_count = 3;
+
+   switch (m_segment_sizing)
+   {
+      case HC_SEGMENT_SIZING_CACHE:
       {
-         for (auto& se : sizes)
+         size_t cache_size = m_segment_sizing_param ? m_segment_sizing_param : get_l2_cache_size ();
+
+         // Assume a small L2 if it cannot be found.
+         if (!cache_size)
          {
-            if (se > min_size)
-            {
-               se /= 2;
-               sizes.push_back(se);
-               break;
-            }
+            cache_size = 256 * 1024;
+         }
+
+         while ((max_size > cache_size) && (max_size > HcLfsr::getMinSize ()))
+         {
+            max_size /= 2;
+         }
+
+         break;
+      }
+
+      case HC_SEGMENT_SIZING_THREADS:
+      {
+         size_t threads = m_segment_sizing_param ? m_segment_sizing_param : std::thread::hardware_concurrency ();
+
+         if (threads > min_count)
+         {
+            min_count = threads;
+         }
+
+         break;
+      }
+
+      default:
+         break;
+   }
+
+   // Within a memory budget, the segments are made smaller until they fit with all the threads and buffers, down to
+   // BUDGET_SEGMENT_SIZE, and then only until they fit at all.
+   if (m_memory_budget)
+   {
+      resetMemoryBudget ();
+
+      // The mapped files do not get smaller with the segments, so they are left to fitMemoryBudget.
+      m_budget_map = false;
+
+      while ((max_size > BUDGET_SEGMENT_SIZE) && (getMemoryNeed (1, max_size, file_size, 1) > m_memory_budget))
+      {
+         max_size /= 2;
+      }
+
+      while ((max_size > HcLfsr::getMinSize ()) && !fitMemoryBudget (1, max_size, file_size, 1))
+      {
+         max_size /= 2;
+      }
+   }
+}
+
+// Use all the threads and buffers, as without a memory budget.
+void HcEnginePrivate::resetMemoryBudget (void)
+{
+   m_budget_map = true;
+   m_budget_threads = m_workers.size ();
+   m_budget_parallel = true;
+   m_budget_part_streams = true;
+   m_budget_multi_cbc = true;
+   m_budget_read_ahead = READ_AHEAD_BLOCKS * READ_AHEAD_BLOCK_SIZE;
+   m_budget_back_buffer = true;
+}
+
+// Get the number of blocks a stream of length bytes is read ahead in: enough for read_ahead bytes, but no more than
+// the stream has, and at least 2, so one is read while the other is used.
+static size_t get_read_ahead_blocks (size_t read_ahead, size_t block_size, uint64_t length)
+{
+   size_t count = (read_ahead + block_size - 1) / block_size;
+   uint64_t needed = (length + block_size - 1) / block_size;
+
+   if (count > needed)
+   {
+      count = (size_t) needed;
+   }
+
+   return std::max (count, (size_t) 2);
+}
+
+// Get the bytes the blocks of a stream of length bytes take, as read_ahead_blocks has them.
+static uint64_t get_read_ahead_size (size_t read_ahead, size_t block_size, uint64_t length)
+{
+   return get_read_ahead_blocks (read_ahead, block_size, length) * std::min ((uint64_t) block_size, length);
+}
+
+/*
+   Get about the most memory needed to encrypt or decrypt total_size bytes in segments of up to segment_size bytes,
+   read from parts files, with the buffers the budget allows.  Mapped files count in full.  On the parallel path, each
+   segment done side by side has its plain and encrypted text, and so do the segments split over all the threads.
+   With one thread, the segment buffer is written behind from a second one, and the input is read ahead, up to its
+   size.  Around the system cache, every thread that reads or writes has an aligned buffer too.
+*/
+uint64_t HcEnginePrivate::getMemoryNeed (int enc, uint64_t segment_size, uint64_t total_size, size_t parts)
+{
+   uint64_t need = MEMORY_OVERHEAD;
+   size_t block_size = READ_AHEAD_BLOCK_SIZE;
+
+   if (usesDirectIo (total_size))
+   {
+      block_size = DIRECT_IO_SIZE;
+   }
+
+   if (runsParallel ())
+   {
+      size_t threads = std::max (m_budget_threads, (size_t) 1);
+
+      if ((HC_IO_MMAP == m_io_mode) && m_budget_map)
+      {
+         need += 2 * total_size;
+      }
+
+      if (m_workers.size () > 1)
+      {
+         need += 2 * segment_size;
+      }
+
+      if (usesDirectIo (total_size))
+      {
+         need += (uint64_t) (threads + 1) * DIRECT_IO_SIZE;
+      }
+
+      return need + (uint64_t) threads * 2 * segment_size;
+   }
+
+   size_t streams = 1;
+
+   if (enc)
+   {
+      uint64_t buffer = segment_size;
+
+      // The batches of the multi-buffer engine have their plain text too.
+      if ((HC_CIPHER_AES_256_CBC == m_cipher) && HcMultiCbc::isSupported ())
+      {
+         if (m_budget_multi_cbc)
+         {
+            uint64_t multi_size = std::min (total_size, segment_size * HcMultiCbc::LANES);
+
+            buffer = std::max (buffer, std::min (multi_size, (uint64_t) MULTI_CBC_BUFFER_SIZE));
+         }
+
+         need += buffer;
+      }
+
+      need += buffer + get_read_ahead_size (m_budget_read_ahead, block_size, total_size);
+
+      if (m_budget_back_buffer && (buffer <= WRITE_BEHIND_SIZE))
+      {
+         need += buffer;
+      }
+   }
+   else
+   {
+      uint64_t staging = std::min (segment_size, (uint64_t) OUTPUT_STAGING_SIZE);
+
+      if ((parts > 1) && m_budget_part_streams)
+      {
+         size_t read_ahead = (size_t) std::max (segment_size, (uint64_t) PART_READ_AHEAD_SIZE);
+
+         streams = parts;
+         need += parts * get_read_ahead_size (read_ahead, block_size, (total_size + parts - 1) / parts);
+      }
+      else
+      {
+         need += get_read_ahead_size (m_budget_read_ahead, block_size, total_size);
+      }
+
+      need += segment_size + staging;
+
+      if (m_budget_back_buffer)
+      {
+         need += staging;
+      }
+   }
+
+   // The readers of the streams and the writer.
+   if (usesDirectIo (total_size))
+   {
+      need += (uint64_t) (streams + 1) * DIRECT_IO_SIZE;
+   }
+
+   return need;
+}
+
+/*
+   Hold back the buffers until the memory needed fits in the budget: first no mapped files, then fewer segments side
+   by side, no read streams per joined part, smaller multi-buffer batches, one thread, less read ahead, and no write
+   behind.  Return false if it still does not fit.
+*/
+bool HcEnginePrivate::fitMemoryBudget (int enc, uint64_t segment_size, uint64_t total_size, size_t parts)
+{
+   resetMemoryBudget ();
+
+   if (!m_memory_budget)
+   {
+      return true;
+   }
+
+   while (getMemoryNeed (enc, segment_size, total_size, parts) > m_memory_budget)
+   {
+      if ((HC_IO_MMAP == m_io_mode) && runsParallel () && m_budget_map)
+      {
+         m_budget_map = false;
+      }
+      else if (runsParallel () && (m_budget_threads > 1))
+      {
+         --m_budget_threads;
+      }
+      else if (m_budget_part_streams)
+      {
+         m_budget_part_streams = false;
+      }
+      else if (m_budget_multi_cbc)
+      {
+         m_budget_multi_cbc = false;
+      }
+      else if (m_budget_parallel)
+      {
+         m_budget_parallel = false;
+      }
+      else if (m_budget_read_ahead > 2 * READ_AHEAD_BLOCK_SIZE)
+      {
+         m_budget_read_ahead /= 2;
+      }
+      else if (m_budget_back_buffer)
+      {
+         m_budget_back_buffer = false;
+      }
+      else
+      {
+         return false;
+      }
+   }
+
+   return true;
+}
+
+// Whether the segments go over the threads of the pool at their offsets, rather than through the stages of one thread.
+bool HcEnginePrivate::runsParallel (void)
+{
+   return ((m_workers.size () > 1) || (HC_IO_MMAP == m_io_mode)) && m_budget_parallel;
+}
+
+// Generate the LFSR specs of a segment for the LFSR or two-level shuffle.
+int HcEnginePrivate::generateLfsrSpecs (HcKeyData& key_data)
+{
+   uint32_t out_size = key_data.m_out_size;
+
+   // With the two-level shuffle, the first LFSR picks the blocks and the second one the bytes within a block.  Segments
+   // too small for it use the single-level shuffle.
+   bool two_level = (HC_SHUFFLE_TWO_LEVEL == key_data.m_shuffle) && (out_size >= TWO_LEVEL_MIN_SIZE);
+
+   key_data.m_shuffle = two_level ? HC_SHUFFLE_TWO_LEVEL : HC_SHUFFLE_LFSR;
+
+   int retries = 4;
+
+   while (--retries)
+   {
+      if (m_lfsr->reset (two_level ? out_size / TWO_LEVEL_BLOCK_SIZE : out_size, 0, -1))
+      {
+         break;
+      }
+   }
+
+   if (!retries)
+   {
+      return HC_INTERNAL_ERROR_CANNOT_RESET_LFSR;
+   }
+
+   if (two_level)
+   {
+      key_data.m_block_lfsr_specs = m_lfsr->getSpec ();
+
+      if (!key_data.m_block_lfsr_specs)
+      {
+         return HC_INTERNAL_ERROR_BAD_LFSR_SPECS;
+      }
+
+      retries = 4;
+
+      while (--retries)
+      {
+         if (m_lfsr->reset (TWO_LEVEL_BLOCK_SIZE, 0, -1))
+         {
+            break;
+         }
+      }
+
+      if (!retries)
+      {
+         return HC_INTERNAL_ERROR_CANNOT_RESET_LFSR;
+      }
+   }
+
+   key_data.m_lfsr_specs = m_lfsr->getSpec ();
+
+   if (!key_data.m_lfsr_specs)
+   {
+      return HC_INTERNAL_ERROR_BAD_LFSR_SPECS;
+   }
+
+   return HC_STATUS_OK;
+}
+
+// Generate an encryption key.
+int HcEnginePrivate::generateKey (int64_t file_size)
+{
+   uint32_t min_size = HcLfsr::getMinSize ();
+   uint32_t max_size = 0;
+   size_t min_key_count = 0;
+
+   getSegmentLimits (file_size, max_size, min_key_count);
+
+   std::vector<uint32_t> sizes;
+
+   int64_t s = file_size;
+
+   // Divide up the total size into power of 2 segment sizes.  The segments go down to the smallest LFSR size (256 bytes),
+   // so only the last segment is padded and the output is at most that much bigger than the input.
+   while (s && (max_size >= min_size))
+   {
+      if (s > max_size)
+      {
+         s -= max_size;
+         sizes.push_back (max_size);
+         continue;
+      }
+
+      max_size /= 2;
+   }
+
+   // The leftover is a key too.
+   if (s)
+   {
+      --min_key_count;
+   }
+
+   // Make sure at least min_key_count keys are used, by halving the biggest segments, or as many as there can be once
+   // they are all as small as they go.
+   while (!sizes.empty () && (sizes.size () < min_key_count))
+   {
+      uint32_t biggest = *std::max_element (sizes.begin (), sizes.end ());
+      size_t count = sizes.size ();
+
+      if (biggest <= min_size)
+      {
+         break;
+      }
+
+      for (size_t i = 0; (i < count) && (sizes.size () < min_key_count); ++i)
+      {
+         if (sizes[i] == biggest)
+         {
+            sizes[i] /= 2;
+            sizes.push_back (sizes[i]);
          }
       }
    }
@@ -515,26 +1516,27 @@ int HcEnginePrivate::generateKey (int64_t file_size)
       key_data.m_in_size = se;
       key_data.m_out_size = out_size;
 
-      int retries = 4;
+      key_data.m_shuffle = m_shuffle;
+      key_data.m_cipher = m_cipher;
+      key_data.m_lfsr_specs = 0;
+      key_data.m_block_lfsr_specs = 0;
 
-      while (--retries)
+      // The Feistel shuffle only needs a random key.
+      if (HC_SHUFFLE_FEISTEL == m_shuffle)
       {
-         if (m_lfsr->reset (out_size, 0, -1))
+         if (!randFill (&key_data.m_shuffle_key[0], sizeof (key_data.m_shuffle_key)))
          {
-            break;
+            return HC_INTERNAL_ERROR_CANNOT_RAND_FILL;
          }
       }
-
-      if (!retries)
+      else
       {
-         return HC_INTERNAL_ERROR_CANNOT_RESET_LFSR;
-      }
+         int status = generateLfsrSpecs (key_data);
 
-      key_data.m_lfsr_specs = m_lfsr->getSpec ();
-
-      if (!key_data.m_lfsr_specs)
-      {
-         return HC_INTERNAL_ERROR_BAD_LFSR_SPECS;
+         if (HC_STATUS_OK != status)
+         {
+            return status;
+         }
       }
 
       // Generate random AES key and vector.
@@ -543,6 +1545,12 @@ int HcEnginePrivate::generateKey (int64_t file_size)
          return HC_INTERNAL_ERROR_CANNOT_RAND_FILL;
       }
 
+      // The first 4 bytes of a ChaCha20 IV are its 32-bit block counter, so start it at 0 to leave room for the segment.
+      if (HC_CIPHER_CHACHA20 == m_cipher)
+      {
+         memset (&key_data.m_iv[0], 0, 4);
+      }
+
       if (!randFill (&key_data.m_key[0], sizeof (key_data.m_key)))
       {
          return HC_INTERNAL_ERROR_CANNOT_RAND_FILL;
@@ -554,550 +1562,2037 @@ int HcEnginePrivate::generateKey (int64_t file_size)
    // Suffle the key segments.
    if (!m_key.empty ())
    {
-      uint8_t max_index = (uint8_t)(m_key.size() - 1);
-      std::random_device rd;
-      std::mt19937 gen(rd());
+      std::random_device rd;
+      std::mt19937 gen(rd());
+
+      std::shuffle (m_key.begin (), m_key.end (), gen);
+   }
+
+   HC_CALLBACK (HC_STATUS_KEY_CREATION_PROGRESS, 100);
+
+   return HC_STATUS_OK;
+}
+
+// Set up the shuffler of a segment.  Return 0 if the key of the segment is not valid.
+HcShuffler* HcEnginePrivate::getShuffler (const HcKeyData& key_data, Worker& worker)
+{
+   switch (key_data.m_shuffle)
+   {
+      case HC_SHUFFLE_LFSR:
+         return worker.m_lfsr_shuffler.setSpec (key_data.m_lfsr_specs) ? &worker.m_lfsr_shuffler : 0;
+
+      case HC_SHUFFLE_TWO_LEVEL:
+         return worker.m_two_level_shuffler.setSpec (key_data.m_block_lfsr_specs, key_data.m_lfsr_specs, key_data.m_out_size) ? &worker.m_two_level_shuffler : 0;
+
+      case HC_SHUFFLE_FEISTEL:
+         return worker.m_feistel_shuffler.setKey (key_data.m_shuffle_key, key_data.m_out_size) ? &worker.m_feistel_shuffler : 0;
+
+      default:
+         return 0;
+   }
+}
+
+// Set up the cipher of the worker for the segment, starting at the given IV.
+bool HcEnginePrivate::initCipher (Worker& worker, const HcKeyData& key_data, const uint8_t* iv, int enc)
+{
+   const HcCipherScheme* scheme = find_cipher_scheme (key_data.m_cipher);
+
+   if (!worker.m_cipher_ctx || !scheme || (1 != EVP_CipherInit_ex (worker.m_cipher_ctx, scheme->m_evp (), 0, 0, 0, enc)))
+   {
+      return false;
+   }
+
+   // The GCM controls are the same as the generic AEAD ones, which OpenSSL 1.0 does not have.
+   if (scheme->m_tag)
+   {
+      if (1 != EVP_CIPHER_CTX_ctrl (worker.m_cipher_ctx, EVP_CTRL_GCM_SET_IVLEN, GCM_IV_SIZE, 0))
+      {
+         return false;
+      }
+   }
+
+   if (1 != EVP_CipherInit_ex (worker.m_cipher_ctx, 0, 0, key_data.m_key, iv, enc))
+   {
+      return false;
+   }
+
+   EVP_CIPHER_CTX_set_padding (worker.m_cipher_ctx, 0);
+
+   // The tag is checked by finishCipher.
+   if (!enc && scheme->m_tag)
+   {
+      if (1 != EVP_CIPHER_CTX_ctrl (worker.m_cipher_ctx, EVP_CTRL_GCM_SET_TAG, GCM_TAG_SIZE, (void*) key_data.m_tag))
+      {
+         return false;
+      }
+   }
+
+   return true;
+}
+
+// Finish the cipher of the worker.  With a tag, this gets it when encrypting and checks it when decrypting.
+int HcEnginePrivate::finishCipher (Worker& worker, HcKeyData& key_data, int enc)
+{
+   uint8_t last[32];
+   int out_len = 0;
+
+   if ((1 != EVP_CipherFinal_ex (worker.m_cipher_ctx, last, &out_len)) || out_len)
+   {
+      return enc ? HC_ERROR_CANNOT_ENCRYPT_SECTION : HC_ERROR_CANNOT_DECRYPT_SECTION;
+   }
+
+   if (enc && find_cipher_scheme (key_data.m_cipher)->m_tag)
+   {
+      if (1 != EVP_CIPHER_CTX_ctrl (worker.m_cipher_ctx, EVP_CTRL_GCM_GET_TAG, GCM_TAG_SIZE, key_data.m_tag))
+      {
+         return HC_ERROR_CANNOT_ENCRYPT_SECTION;
+      }
+   }
+
+   return HC_STATUS_OK;
+}
+
+// Scatter the chunk_count encrypted chunks in in into the segment in ob at the next chunks of the shuffler.
+int HcEnginePrivate::scatterChunks (HcShuffler* shuffler, const uint8_t* in, uint8_t* ob, uint32_t chunk_count)
+{
+   uint32_t chunk_size = CHUNK_SIZE;
+   HcChunkMap map;
+
+   for (uint32_t c = 0; c < chunk_count; ++c)
+   {
+      const uint8_t* cb = &in[c * chunk_size];
+
+      if (!shuffler->next (ob, map))
+      {
+         return HC_INTERNAL_ERROR_BAD_LFSR_FILL;
+      }
+
+      uint8_t* base = map.m_base;
+      const uint32_t* ci = map.m_indices;
+      uint32_t stride = map.m_stride;
+
+      for (uint32_t i = 0; i < chunk_size - 1; ++i)
+      {
+         base[ci[i * stride]] = cb[i];
+      }
+
+      // If this is the last chunk of the map, the last byte should go into index 0 since index 0 is never generated by the LFSR.
+      base[map.m_last ? 0 : ci[(chunk_size - 1) * stride]] = cb[chunk_size - 1];
+   }
+
+   return HC_STATUS_OK;
+}
+
+// Encrypt the chunk_count chunks in in, and scatter them into the segment in ob at the next chunks of the shuffler.
+int HcEnginePrivate::scatterEncrypt (Worker& worker, HcShuffler* shuffler, uint8_t* in, uint8_t* ob, uint32_t chunk_count)
+{
+   int out_len = 0;
+
+   if ((1 != EVP_EncryptUpdate (worker.m_cipher_ctx, in, &out_len, in, (int) (chunk_count * CHUNK_SIZE))) ||
+       (out_len != (int) (chunk_count * CHUNK_SIZE)))
+   {
+      return HC_ERROR_CANNOT_ENCRYPT_SECTION;
+   }
+
+   return scatterChunks (shuffler, in, ob, chunk_count);
+}
+
+// Encrypt chunk_count chunks of plain text in in, which start at first_chunk of the segment, into the segment in ob.
+// Only a seekable scheme can start past the first chunk.
+int HcEnginePrivate::encryptChunks (Worker& worker, HcKeyData& key_data, uint8_t* in, uint32_t first_chunk, uint32_t chunk_count, uint8_t* ob)
+{
+   HcShuffler* shuffler = getShuffler (key_data, worker);
+
+   if (!shuffler)
+   {
+      return HC_INTERNAL_ERROR_CANNOT_SET_LFSR_SPEC;
+   }
+
+   if (!shuffler->start (key_data.m_in_size, first_chunk))
+   {
+      return HC_INTERNAL_ERROR_BAD_LFSR_FILL;
+   }
+
+   const HcCipherScheme* scheme = find_cipher_scheme (key_data.m_cipher);
+   uint8_t iv[sizeof (key_data.m_iv)];
+
+   // Any scheme can start at the first chunk, but only a seekable one anywhere else.
+   if (!scheme)
+   {
+      return HC_INTERNAL_ERROR_CANNOT_INIT_CIPHER;
+   }
+
+   if (!first_chunk)
+   {
+      memcpy (iv, key_data.m_iv, sizeof (iv));
+   }
+   else if (!scheme->m_seek || !scheme->m_seek (key_data.m_iv, first_chunk, iv))
+   {
+      return HC_INTERNAL_ERROR_CANNOT_INIT_CIPHER;
+   }
+
+   if (!initCipher (worker, key_data, iv, 1))
+   {
+      return HC_INTERNAL_ERROR_CANNOT_INIT_CIPHER;
+   }
+
+   while (chunk_count)
+   {
+      uint32_t run_chunks = CRYPTO_RUN_SIZE / CHUNK_SIZE;
+
+      if (run_chunks > chunk_count)
+      {
+         run_chunks = chunk_count;
+      }
+
+      int status = scatterEncrypt (worker, shuffler, in, ob, run_chunks);
+
+      if (HC_STATUS_OK != status)
+      {
+         return status;
+      }
+
+      in += run_chunks * CHUNK_SIZE;
+      chunk_count -= run_chunks;
+   }
+
+   return finishCipher (worker, key_data, 1);
+}
+
+// Start the reader and writer stages of one thread.  The input is read read_ahead bytes ahead in streams that end at
+// in_ends, one after the other, and the output is written behind when a back buffer of back_size bytes can be had.
+// With io_uring, the kernel does the reading and writing with several requests in flight, and the stages need no
+// threads.  Direct files are read and written by the stages at their offsets, in fewer and bigger blocks, and so are
+// several streams, each with its own reader.  If a stage cannot get a thread, it does its jobs in line.
+int HcEnginePrivate::startStages (const std::vector<uint64_t>& in_ends, size_t read_ahead, size_t back_size)
+{
+   size_t block_size = m_direct_io ? DIRECT_IO_SIZE : READ_AHEAD_BLOCK_SIZE;
+
+   m_transfer_at = m_direct_io || (in_ends.size () > 1);
+
+   if (m_transfer_at || !m_uring.open (URING_ENTRIES, READ_AHEAD_BLOCKS + 2))
+   {
+      m_writer.start ();
+   }
+
+   m_back_ticket = 0;
+   m_write_position = 0;
+   m_uring_write_group = 0;
+
+   try
+   {
+      uint64_t start = 0;
+
+      m_read_streams.clear ();
+
+      for (auto end : in_ends)
+      {
+         std::unique_ptr<ReadStream> stream (new ReadStream);
+
+         stream->m_block = 0;
+         stream->m_offset = 0;
+         stream->m_left = end - start;
+         stream->m_position = start;
+         stream->m_blocks.resize (get_read_ahead_blocks (read_ahead, block_size, end - start));
+
+         for (auto& block : stream->m_blocks)
+         {
+            block.m_data.resize ((size_t) std::min ((uint64_t) block_size, end - start));
+         }
+
+         if (!m_uring.isOpen ())
+         {
+            stream->m_reader.start ();
+         }
+
+         m_read_streams.push_back (std::move (stream));
+         start = end;
+      }
+   }
+   catch (...)
+   {
+      return HC_ERROR_BLOCK_SIZE_TOO_BIG;
+   }
+
+   m_read_stream = m_read_streams[0].get ();
+
+   // Without the back buffer, every write is waited for.
+   if (back_size <= WRITE_BEHIND_SIZE)
+   {
+      try
+      {
+         m_back_buffer.resize (back_size);
+      }
+      catch (...)
+      {
+         m_back_buffer.clear ();
+      }
+   }
+
+   // The blocks are read into over and over, so the kernel can keep them mapped.
+   if (m_uring.isOpen ())
+   {
+      std::vector<uint8_t*> buffers;
+
+      for (auto& block : m_read_stream->m_blocks)
+      {
+         buffers.push_back (&block.m_data[0]);
+      }
+
+      m_uring.registerBuffers (&buffers[0], (unsigned int) buffers.size (), m_read_stream->m_blocks[0].m_data.size ());
+   }
+
+   for (auto& stream : m_read_streams)
+   {
+      for (size_t i = 0; i < stream->m_blocks.size (); ++i)
+      {
+         readAhead (*stream, i);
+      }
+   }
+
+   return HC_STATUS_OK;
+}
+
+// Have the reader stage fill a block with the next bytes of the input, if any are left.
+void HcEnginePrivate::readAhead (ReadStream& stream, size_t index)
+{
+   ReadBlock& block = stream.m_blocks[index];
+
+   block.m_size = block.m_data.size ();
+
+   if (block.m_size > stream.m_left)
+   {
+      block.m_size = (size_t) stream.m_left;
+   }
+
+   stream.m_left -= block.m_size;
+   block.m_ticket = 0;
+
+   // A failed submission shows up as the block not being read.
+   if (block.m_size && m_uring.isOpen ())
+   {
+      if (!transferAt (m_in_files, &block.m_data[0], block.m_size, stream.m_position, false, (int) index))
+      {
+         block.m_size = 0;
+      }
+
+      stream.m_position += block.m_size;
+   }
+   else if (block.m_size && m_transfer_at)
+   {
+      uint8_t* buffer = &block.m_data[0];
+      size_t size = block.m_size;
+      uint64_t offset = stream.m_position;
+
+      block.m_ticket = stream.m_reader.submit ([this, buffer, size, offset]
+      {
+         return transferAt (m_in_files, buffer, size, offset, false) ? HC_STATUS_OK : HC_ERROR_CANNOT_READ_INPUT_FILE;
+      });
+
+      stream.m_position += size;
+   }
+   else if (block.m_size)
+   {
+      uint8_t* buffer = &block.m_data[0];
+      size_t size = block.m_size;
+
+      block.m_ticket = stream.m_reader.submit ([this, buffer, size] { return readFiles (buffer, size); });
+   }
+}
+
+// Read the next bytes of the input files, going from one file to the next.  This is done by the reader stage.
+int HcEnginePrivate::readFiles (uint8_t* buffer, size_t size)
+{
+   while (size)
+   {
+      if ((m_in_file_index >= m_in_files.size ()) || !m_in_files[m_in_file_index].m_file)
+      {
+         return HC_ERROR_CANNOT_READ_INPUT_FILE;
+      }
+
+      size_t res = fread (buffer, 1, size, m_in_files[m_in_file_index].m_file);
+
+      if (res != size)
+      {
+         ++m_in_file_index;
+      }
+
+      size -= res;
+      buffer += res;
+   }
+
+   return HC_STATUS_OK;
+}
+
+// Take the next bytes of the current read stream from the blocks read ahead, and read the next block into each one used
+// up.
+int HcEnginePrivate::readInput (uint8_t* buffer, size_t size)
+{
+   ReadStream& stream = *m_read_stream;
+
+   while (size)
+   {
+      ReadBlock& block = stream.m_blocks[stream.m_block];
+      int status = stream.m_reader.wait (block.m_ticket);
+
+      if (m_uring.isOpen () && !m_uring.wait ((unsigned int) stream.m_block))
+      {
+         status = HC_ERROR_CANNOT_READ_INPUT_FILE;
+      }
+
+      if (HC_STATUS_OK != status)
+      {
+         return status;
+      }
+
+      if (!block.m_size)
+      {
+         return HC_ERROR_CANNOT_READ_INPUT_FILE;
+      }
+
+      size_t part = block.m_size - stream.m_offset;
+
+      if (part > size)
+      {
+         part = size;
+      }
+
+      memcpy (buffer, &block.m_data[stream.m_offset], part);
+
+      stream.m_offset += part;
+      buffer += part;
+      size -= part;
+
+      if (stream.m_offset == block.m_size)
+      {
+         stream.m_offset = 0;
+         readAhead (stream, stream.m_block);
+         stream.m_block = (stream.m_block + 1) % stream.m_blocks.size ();
+      }
+   }
+
+   return HC_STATUS_OK;
+}
+
+// Write an encrypted segment to the output files, moving on to the next split when one is full.  With one thread, this
+// is done by the writer stage.
+int HcEnginePrivate::writeSegment (const uint8_t* ob, size_t size)
+{
+   size_t bytes_to_write = size;
+
+   // While there are bytes to write for this segment...
+   while (bytes_to_write)
+   {
+      if (m_out_file_index >= m_out_files.size ())
+      {
+         return HC_ERROR_CANNOT_WRITE_OUTPUT_FILE;
+      }
+
+      size_t chunk = bytes_to_write;
+
+      // If the segment size is larger than the max file size...
+      if (chunk > m_out_files[m_out_file_index].m_size)
+      {
+         chunk = m_out_files[m_out_file_index].m_size;
+      }
+
+      // Write what we can write for now.
+      if (1 != fwrite (ob, chunk, 1, m_out_files[m_out_file_index].m_file))
+      {
+         return HC_ERROR_CANNOT_WRITE_OUTPUT_FILE;
+      }
+
+      m_out_files[m_out_file_index].m_size -= chunk;
+      bytes_to_write -= chunk;
+      ob += chunk;
+
+      // If we reached the max file size...
+      if (!m_out_files[m_out_file_index].m_size)
+      {
+         // Close this file since we are done with it.
+         fclose (m_out_files[m_out_file_index].m_file);
+         m_out_files[m_out_file_index].m_file = 0;
+
+         ++m_out_file_index;
+      }
+   }
+
+   return HC_STATUS_OK;
+}
+
+// Have the writer stage write size bytes of buffer, and swap in the back buffer, so the next output is made while this
+// one is written.  The back buffer is only handed out once the writer is done with it.
+int HcEnginePrivate::writeBehind (std::vector<uint8_t>& buffer, size_t size)
+{
+   // On the io_uring, the writes of each buffer are a group, and the files are written at their offsets.
+   if (m_uring.isOpen ())
+   {
+      unsigned int group = URING_WRITE_GROUP + m_uring_write_group;
+
+      if (!transferAt (m_out_files, &buffer[0], size, m_write_position, true, (int) group))
+      {
+         return HC_ERROR_CANNOT_WRITE_OUTPUT_FILE;
+      }
+
+      m_write_position += size;
+
+      if (m_back_buffer.size () == buffer.size ())
+      {
+         buffer.swap (m_back_buffer);
+         m_uring_write_group ^= 1;
+         group = URING_WRITE_GROUP + m_uring_write_group;
+      }
+
+      return m_uring.wait (group) ? HC_STATUS_OK : HC_ERROR_CANNOT_WRITE_OUTPUT_FILE;
+   }
+
+   uint8_t* ob = &buffer[0];
+   uint64_t offset = m_write_position;
+   uint64_t ticket;
+
+   // Direct files, and the segments of joined parts, are written at their offsets.
+   if (m_transfer_at)
+   {
+      ticket = m_writer.submit ([this, ob, size, offset]
+      {
+         return transferAt (m_out_files, ob, size, offset, true) ? HC_STATUS_OK : HC_ERROR_CANNOT_WRITE_OUTPUT_FILE;
+      });
+
+      m_write_position += size;
+   }
+   else
+   {
+      ticket = m_writer.submit ([this, ob, size] { return writeSegment (ob, size); });
+   }
+
+   if (m_back_buffer.size () == buffer.size ())
+   {
+      buffer.swap (m_back_buffer);
+      std::swap (ticket, m_back_ticket);
+   }
+
+   return m_writer.wait (ticket);
+}
+
+// Wait for all the output to be written.
+int HcEnginePrivate::waitWrites (void)
+{
+   if (m_uring.isOpen ())
+   {
+      bool written = m_uring.wait (URING_WRITE_GROUP);
+
+      if (!m_uring.wait (URING_WRITE_GROUP + 1) || !written)
+      {
+         return HC_ERROR_CANNOT_WRITE_OUTPUT_FILE;
+      }
+   }
+
+   return m_writer.waitAll ();
+}
+
+// Encrypt the next segment.  Return the status.
+int HcEnginePrivate::encryptSegment (HcKeyData& key_data)
+{
+   Worker& worker = *m_workers[0];
+
+   if (!key_data.m_in_size || (key_data.m_out_size < key_data.m_in_size))
+   {
+      return HC_INTERNAL_ERROR_INVALID_INPUT_SEGMENT_SIZE;
+   }
+
+   HcShuffler* shuffler = getShuffler (key_data, worker);
+
+   if (!shuffler)
+   {
+      return HC_INTERNAL_ERROR_CANNOT_SET_LFSR_SPEC;
+   }
+
+   HC_CALLBACK (HC_STATUS_ENCRYPT_SECTION_START, 0);
+
+   if ((size_t) key_data.m_out_size > m_buffer.size ())
+   {
+      return HC_INTERNAL_ERROR_BAD_TEMP_BUFFER;
+   }
+
+   uint8_t* ob = &m_buffer[0];
+
+   // If there is a chance that a slot in the output is not going to be filled, fill the whole output buffer with random numbers.
+   if (key_data.m_out_size != key_data.m_in_size)
+   {
+      randFill (ob, key_data.m_out_size);
+   }
+
+   uint32_t is = key_data.m_in_size;
+   uint32_t chunk_size = CHUNK_SIZE;
+   std::vector<uint8_t> in_buf;
+
+   if (!shuffler->start (key_data.m_in_size, 0))
+   {
+      return HC_INTERNAL_ERROR_BAD_LFSR_FILL;
+   }
+
+   in_buf.resize (CRYPTO_RUN_SIZE);
+
+   // The IV is chained from chunk to chunk, so the segment is one stream and can be encrypted a run at a time.
+   if (!initCipher (worker, key_data, key_data.m_iv, 1))
+   {
+      return HC_INTERNAL_ERROR_CANNOT_INIT_CIPHER;
+   }
+
+   double progress = 0;
+   double progress_inc = (double) CRYPTO_RUN_SIZE * 100.0 / (double) is;
+   double old_progress = 0;
+
+   while (is)
+   {
+      uint32_t run = CRYPTO_RUN_SIZE;
+
+      if (run > is)
+      {
+         run = is;
+      }
+
+      uint32_t run_chunks = (run + chunk_size - 1) / chunk_size;
+
+      // If the last chunk is less than the minimum chunk size, pad with randoms.
+      if (run < run_chunks * chunk_size)
+      {
+         randFill (&in_buf[run], run_chunks * chunk_size - run);
+      }
+
+      int status = readInput (&in_buf[0], run);
+
+      if (HC_STATUS_OK != status)
+      {
+         return status;
+      }
+
+      is -= run;
+
+      status = scatterEncrypt (worker, shuffler, &in_buf[0], ob, run_chunks);
+
+      if (HC_STATUS_OK != status)
+      {
+         return status;
+      }
+
+      progress += progress_inc;
+
+      if ((progress - old_progress) >= 5.0)
+      {
+         HC_CALLBACK (HC_STATUS_ENCRYPT_SECTION_PROGRESS, progress);
+         old_progress = progress;
+      }
+   }
+
+   int status = finishCipher (worker, key_data, 1);
+
+   if (HC_STATUS_OK != status)
+   {
+      return status;
+   }
+
+   status = writeBehind (m_buffer, key_data.m_out_size);
+
+   if (HC_STATUS_OK != status)
+   {
+      return status;
+   }
+
+   HC_CALLBACK (HC_STATUS_ENCRYPT_SECTION_PROGRESS, 100);
+   HC_CALLBACK (HC_STATUS_ENCRYPT_SECTION_END, 0);
+
+   return HC_STATUS_OK;
+}
+
+// Get how many segments, starting at first, can be encrypted together on the lanes of the multi-buffer CBC engine:
+// consecutive CBC segments, whose output fits in the segment buffer together.
+size_t HcEnginePrivate::getMultiCbcBatch (size_t first)
+{
+   size_t count = 0;
+   size_t size = 0;
+
+   if (!HcMultiCbc::isSupported ())
+   {
+      return 0;
+   }
+
+   while ((first + count < m_key.size ()) && (count < HcMultiCbc::LANES))
+   {
+      const HcKeyData& key_data = m_key[first + count];
+
+      if ((HC_CIPHER_AES_256_CBC != key_data.m_cipher) || (size + key_data.m_out_size > m_buffer.size ()))
+      {
+         break;
+      }
+
+      size += key_data.m_out_size;
+      ++count;
+   }
+
+   return count;
+}
+
+/*
+   Encrypt count CBC segments, starting at first, together.  Their input is read first, one segment after the other,
+   since it comes in order.  Every segment is a CBC stream of its own, so the streams are interleaved on the lanes of
+   the multi-buffer engine, a run of each at a time.  The lanes go from the biggest segment to the smallest one, so the ones still running are always
+   the first lanes.  The output of the segments is in the segment buffer, one after the other, and is written in order.
+*/
+int HcEnginePrivate::encryptSegments (size_t first, size_t count)
+{
+   struct Lane
+   {
+      HcKeyData* m_key_data;
+      HcShuffler* m_shuffler;
+      uint8_t* m_ob;
+      uint8_t* m_in;
+      uint32_t m_in_left;
+   };
+
+   std::vector<Lane> lanes (count);
+   size_t out_offset = 0;
+   size_t in_offset = 0;
+
+   if (count > HcMultiCbc::LANES)
+   {
+      return HC_INTERNAL_ERROR_INVALID_INPUT_SEGMENT_SIZE;
+   }
+
+   while (m_lane_workers.size () < count)
+   {
+      m_lane_workers.push_back (new Worker);
+   }
+
+   for (size_t i = 0; i < count; ++i)
+   {
+      HcKeyData& key_data = m_key[first + i];
+      Lane& lane = lanes[i];
+
+      if (!key_data.m_in_size || (key_data.m_out_size < key_data.m_in_size))
+      {
+         return HC_INTERNAL_ERROR_INVALID_INPUT_SEGMENT_SIZE;
+      }
+
+      if (out_offset + key_data.m_out_size > m_buffer.size ())
+      {
+         return HC_INTERNAL_ERROR_BAD_TEMP_BUFFER;
+      }
+
+      lane.m_key_data = &key_data;
+      lane.m_ob = &m_buffer[out_offset];
+      lane.m_in_left = key_data.m_in_size;
+
+      out_offset += key_data.m_out_size;
+      in_offset += ((key_data.m_in_size + CHUNK_SIZE - 1) / CHUNK_SIZE) * CHUNK_SIZE;
+   }
+
+   try
+   {
+      m_plain_buffer.resize (in_offset);
+   }
+   catch (...)
+   {
+      return HC_ERROR_BLOCK_SIZE_TOO_BIG;
+   }
+
+   in_offset = 0;
+
+   for (size_t i = 0; i < count; ++i)
+   {
+      Lane& lane = lanes[i];
+      uint32_t padded = ((lane.m_in_left + CHUNK_SIZE - 1) / CHUNK_SIZE) * CHUNK_SIZE;
+
+      lane.m_in = &m_plain_buffer[in_offset];
+
+      int status = readInput (lane.m_in, lane.m_in_left);
+
+      if (HC_STATUS_OK != status)
+      {
+         return status;
+      }
+
+      // If the last chunk is less than the minimum chunk size, pad with randoms.
+      if (padded > lane.m_in_left)
+      {
+         randFill (&lane.m_in[lane.m_in_left], padded - lane.m_in_left);
+      }
+
+      in_offset += padded;
+   }
+
+   std::stable_sort (lanes.begin (), lanes.end (), [] (const Lane& a, const Lane& b)
+   {
+      return a.m_in_left > b.m_in_left;
+   });
+
+   for (size_t i = 0; i < count; ++i)
+   {
+      Lane& lane = lanes[i];
+      HcKeyData& key_data = *lane.m_key_data;
+
+      HC_CALLBACK (HC_STATUS_ENCRYPT_SECTION_START, 0);
+
+      // If there is a chance that a slot in the output is not going to be filled, fill the whole output buffer with random numbers.
+      if (key_data.m_out_size != key_data.m_in_size)
+      {
+         randFill (lane.m_ob, key_data.m_out_size);
+      }
+
+      lane.m_shuffler = getShuffler (key_data, *m_lane_workers[i]);
+
+      if (!lane.m_shuffler)
+      {
+         return HC_INTERNAL_ERROR_CANNOT_SET_LFSR_SPEC;
+      }
+
+      if (!lane.m_shuffler->start (key_data.m_in_size, 0))
+      {
+         return HC_INTERNAL_ERROR_BAD_LFSR_FILL;
+      }
+
+      if (!m_multi_cbc.setLane ((uint32_t) i, key_data.m_key, key_data.m_iv))
+      {
+         return HC_INTERNAL_ERROR_CANNOT_INIT_CIPHER;
+      }
+   }
+
+   uint32_t active = (uint32_t) count;
+
+   while (active)
+   {
+      // All the running lanes move on by as many chunks as the smallest one has left, up to a run.
+      uint32_t run_chunks = CRYPTO_RUN_SIZE / CHUNK_SIZE;
+      uint32_t last_chunks = (lanes[active - 1].m_in_left + CHUNK_SIZE - 1) / CHUNK_SIZE;
+      uint8_t* data[HcMultiCbc::LANES];
+
+      if (run_chunks > last_chunks)
+      {
+         run_chunks = last_chunks;
+      }
+
+      for (uint32_t i = 0; i < active; ++i)
+      {
+         Lane& lane = lanes[i];
+         uint32_t run = run_chunks * CHUNK_SIZE;
+
+         data[i] = lane.m_in;
+
+         if (run > lane.m_in_left)
+         {
+            run = lane.m_in_left;
+         }
+
+         lane.m_in += run_chunks * CHUNK_SIZE;
+         lane.m_in_left -= run;
+      }
+
+      if (!m_multi_cbc.encrypt (active, data, run_chunks * (CHUNK_SIZE / HcMultiCbc::BLOCK_SIZE)))
+      {
+         return HC_ERROR_CANNOT_ENCRYPT_SECTION;
+      }
+
+      for (uint32_t i = 0; i < active; ++i)
+      {
+         int status = scatterChunks (lanes[i].m_shuffler, data[i], lanes[i].m_ob, run_chunks);
+
+         if (HC_STATUS_OK != status)
+         {
+            return status;
+         }
+      }
+
+      while (active && !lanes[active - 1].m_in_left)
+      {
+         --active;
+      }
+   }
+
+   int status = writeBehind (m_buffer, out_offset);
+
+   if (HC_STATUS_OK != status)
+   {
+      return status;
+   }
+
+   for (size_t i = 0; i < count; ++i)
+   {
+      HC_CALLBACK (HC_STATUS_ENCRYPT_SECTION_PROGRESS, 100);
+      HC_CALLBACK (HC_STATUS_ENCRYPT_SECTION_END, 0);
+   }
+
+   return HC_STATUS_OK;
+}
+
+// Encrypt a file.
+int HcEnginePrivate::encryptFile (const char* in_file_path, uint32_t splits)
+{
+   if (!in_file_path || !in_file_path[0])
+   {
+      return HC_ERROR_BAD_INPUT_FILE_NAME;
+   }
+
+   HC_CALLBACK(HC_STATUS_ENCRYPT_START, 0);
+
+   boost::filesystem::path in_path(in_file_path);
+
+   std::string in_file_name = getOutputFileName (in_path.filename().generic_string());
+
+   m_key_file.clear ();
+
+   std::string key_file_name = in_file_name + ".hckey";
+
+   if (boost::filesystem::exists(key_file_name))
+   {
+      return HC_ERROR_KEY_FILE_ALREADY_EXISTS;
+   }
+
+   m_key_file.m_file_name = key_file_name;
+   m_key_file.m_temp_file_name = getOutputFileName (getTempFileName ()) + "-hctemp";
+
+   m_out_files.clear();
+   m_out_file_index = 0;
+
+   if (splits)
+   {
+      FileSpec fs;
+
+      fs.m_file = 0;
+      fs.m_size = 0;
+
+	  // If the output file is to be split, generate the output file names.
+      for (size_t i = 0; i < splits; ++i)
+      {
+         fs.m_file_name = getSplitFileName (in_file_name, i);
+
+         if (boost::filesystem::exists(fs.m_file_name))
+         {
+            m_out_files.clear ();
+            return HC_ERROR_OUTPUT_FILE_ALREADY_EXISTS;
+         }
+
+         m_out_files.push_back (fs);
+      }
+   }
+   else
+   {
+      FileSpec fs;
+
+      fs.m_file = 0;
+      fs.m_size = 0;
+
+      fs.m_file_name = in_file_name;
+      fs.m_file_name += ".hc";
+
+      if (boost::filesystem::exists(fs.m_file_name))
+      {
+         m_out_files.clear ();
+         return HC_ERROR_OUTPUT_FILE_ALREADY_EXISTS;
+      }
+
+      m_out_files.push_back (fs);
+   }
+
+   // The temp files are made next to the files they are renamed to, which may be on other disks.
+   for (auto& e : m_out_files)
+   {
+      e.m_temp_file_name = (boost::filesystem::path (e.m_file_name).parent_path () / getTempFileName ()).string () + "-hctemp";
+   }
+
+   if (!boost::filesystem::exists (in_file_path))
+   {
+      return HC_ERROR_CANNOT_OPEN_INPUT_FILE;
+   }
+
+   size_t file_size = 0;
+   
+   try
+   {
+	   file_size = boost::filesystem::file_size(in_file_path);
+
+	   if (!file_size)
+	   {
+		   throw;
+	   }
+   }
+   catch (...)
+   {
+	   return HC_ERROR_CANNOT_OPEN_INPUT_FILE;
+   }
+
+   FileSpec in_file_spec;
+
+   in_file_spec.m_file = fopen (in_file_path, "rb");
+   
+   if (!in_file_spec.m_file)
+   {
+      return HC_ERROR_CANNOT_OPEN_INPUT_FILE;
+   }
+
+   m_in_files.clear();
+   m_in_file_index = 0;
+
+   in_file_spec.m_file_name = in_file_path;
+   in_file_spec.m_size = file_size;
+
+   m_in_files.push_back (in_file_spec);
+
+   HC_CALLBACK (HC_STATUS_KEY_CREATION_START, 0);
+
+   // Create the LFSR.
+   m_lfsr = new HcLfsr (0);
+
+   int status = generateKey (file_size);
+
+   if (HC_STATUS_OK != status)
+   {
+      return status;
+   }
+
+   HC_CALLBACK (HC_STATUS_KEY_CREATION_END, 0);
+
+   size_t total_out_size = 0;
+   size_t max_segment_size = 0;
+
+   // Calculate the expected output file size.
+   for (auto& ke : m_key)
+   {
+      if (max_segment_size < ke.m_out_size)
+      {
+         max_segment_size = ke.m_out_size;
+      }
+      total_out_size += ke.m_out_size;
+   }
+
+   if (!fitMemoryBudget (1, max_segment_size, total_out_size, 1))
+   {
+      return HC_ERROR_MEMORY_BUDGET_TOO_SMALL;
+   }
+
+   size_t buffer_size = max_segment_size;
+
+   // With several threads or mapped files, the buffers are allocated as the segments need them.
+   if (runsParallel ())
+   {
+      buffer_size = 0;
+   }
+   // Otherwise, make room for a segment per lane of the multi-buffer CBC engine, within reason.
+   else if (m_budget_multi_cbc && (HC_CIPHER_AES_256_CBC == m_cipher) && HcMultiCbc::isSupported ())
+   {
+      size_t multi_size = std::min (total_out_size, max_segment_size * HcMultiCbc::LANES);
+
+      buffer_size = std::max (buffer_size, std::min (multi_size, (size_t) MULTI_CBC_BUFFER_SIZE));
+   }
+
+   try
+   {
+      m_buffer.resize (buffer_size);
+   }
+   catch (...)
+   {
+   }
+
+   if (m_buffer.size () != buffer_size)
+   {
+      return HC_ERROR_BLOCK_SIZE_TOO_BIG;
+   }
+
+   if (splits)
+   {
+      // Make sure the splits happen at a 256-byte boundary, unless the output is too small to give every split a chunk.
+      // Then the splits are cut at any byte, so small files can still be split.
+      size_t unit = CHUNK_SIZE;
+
+      if (total_out_size / CHUNK_SIZE < splits)
+      {
+         unit = 1;
+      }
+
+      size_t units = total_out_size / unit;
+
+      // Every split must get at least one byte.
+      if (units < splits)
+      {
+         return HC_ERROR_INVALID_OUTPUT_FILE;
+      }
+
+      // Set the size of each split, spreading the leftover units over the first splits.
+      for (size_t i = 0; i < m_out_files.size (); ++i)
+      {
+         m_out_files[i].m_size = (units / splits + ((i < (units % splits)) ? 1 : 0)) * unit;
+      }
+   }
+   else
+   {
+      m_out_files[0].m_size = total_out_size;
+   }
+
+   // Open all the output files for writing, and reading too when they are mapped.
+   for (auto& e : m_out_files)
+   {
+      e.m_file = fopen (e.m_temp_file_name.c_str (), (HC_IO_MMAP == m_io_mode) ? "w+b" : "wb");
+
+      if (!e.m_file)
+      {
+         return HC_ERROR_CANNOT_CREATE_OUTPUT_FILE;
+      }
+   }
+
+   openDirectFiles (file_size);
+
+   size_t progress = 0;
+
+   HC_CALLBACK (HC_STATUS_ENCRYPT_PROGRESS, 0);
+
+   // With several threads, the segments are encrypted side by side, and mapped files are written at their offsets.
+   if (runsParallel ())
+   {
+      status = runParallel (1);
+
+      if (HC_STATUS_OK != status)
+      {
+         return status;
+      }
+   }
+   else
+   {
+      // The input is read and the output written on their own threads, while the segments are encrypted on this one.
+      status = startStages (std::vector<uint64_t> (1, file_size), m_budget_read_ahead,
+                            m_budget_back_buffer ? m_buffer.size () : 0);
+
+      if (HC_STATUS_OK != status)
+      {
+         return status;
+      }
+
+      // Encrypt all the segments in order, several CBC ones at a time when they can share the multi-buffer engine.
+      for (size_t k = 0; k < m_key.size (); )
+      {
+         size_t count = getMultiCbcBatch (k);
+
+         if (count > 1)
+         {
+            status = encryptSegments (k, count);
+         }
+         else
+         {
+            // The segment key gets the GCM tag.
+            count = 1;
+            status = encryptSegment (m_key[k]);
+         }
+
+         if (HC_STATUS_OK != status)
+         {
+            return status;
+         }
+
+         for (size_t i = 0; i < count; ++i, ++k)
+         {
+            progress += m_key[k].m_out_size;
+         }
+
+         HC_CALLBACK (HC_STATUS_ENCRYPT_PROGRESS, ((double)progress * 100.0 / (double)total_out_size));
+      }
+
+      status = waitWrites ();
+
+      if (HC_STATUS_OK != status)
+      {
+         return status;
+      }
+   }
+
+   closeDirectFiles ();
+
+   // The writer closes the output files once they are full, unless they were written at their offsets.
+   for (auto& e : m_out_files)
+   {
+      if (e.m_file)
+      {
+         fclose (e.m_file);
+         e.m_file = 0;
+      }
+   }
+
+   HC_CALLBACK (HC_STATUS_ENCRYPT_PROGRESS, 100);
+
+   if (m_key.empty ())
+   {
+      return HC_ERROR_BAD_KEY;
+   }
+
+   // Create the key file.
+   int result = keyToXmlFile (m_key_file.m_temp_file_name.c_str ());
+
+   if (HC_STATUS_OK != result)
+   {
+      return result;
+   }
+
+   // After the temp output files and temp key file have been written succuessfuly, rename them to the actual file names.
+   // This is used so that no partial files and left over in case an error happens in the middle of the operation.
+   if (!renameTempFile (m_key_file))
+   {
+      return HC_ERROR_CANNOT_WRITE_KEY_FILE;
+   }
+
+   for (auto& e : m_out_files)
+   {
+      if (!renameTempFile (e))
+      {
+         return HC_ERROR_CANNOT_WRITE_OUTPUT_FILE;
+      }
+   }
+
+   for (auto& e : m_out_files)
+   {
+      e.clear ();
+   }
+
+   m_key_file.clear ();
+
+   cleanUp ();
+
+   HC_CALLBACK (HC_STATUS_ENCRYPT_END, 0);
+
+   return HC_STATUS_OK;
+}
+
+// Gather the next chunk_count chunks of the segment in ib from the shuffler, and decrypt them into out.  The chunks are
+// gathered a few at a time into the worker, and decrypted from there, so out is only written once.  Only out_size
+// bytes of out are written, which can leave out the padding of the last chunk, so out can be the output file itself.
+int HcEnginePrivate::gatherDecrypt (Worker& worker, HcShuffler* shuffler, uint8_t* ib, uint8_t* out, uint32_t chunk_count, size_t out_size)
+{
+   uint32_t chunk_size = CHUNK_SIZE;
+   HcChunkMap map;
+
+   while (chunk_count)
+   {
+      uint32_t gather_chunks = GATHER_SIZE / CHUNK_SIZE;
+
+      if (gather_chunks > chunk_count)
+      {
+         gather_chunks = chunk_count;
+      }
+
+      for (uint32_t c = 0; c < gather_chunks; ++c)
+      {
+         uint8_t* cb = &worker.m_gather[c * chunk_size];
+
+         if (!shuffler->next (ib, map))
+         {
+            return HC_INTERNAL_ERROR_BAD_LFSR_FILL;
+         }
+
+         const uint8_t* base = map.m_base;
+         const uint32_t* ci = map.m_indices;
+         uint32_t stride = map.m_stride;
+
+         for (uint32_t i = 0; i < (chunk_size - 1); ++i)
+         {
+            cb[i] = base [ci [i * stride]];
+         }
+
+         cb[chunk_size - 1] = base [map.m_last ? 0 : ci [(chunk_size - 1) * stride]];
+      }
+
+      int gather_size = (int) (gather_chunks * chunk_size);
+      int out_len = 0;
+      bool partial = (size_t) gather_size > out_size;
+      uint8_t* dest = partial ? worker.m_gather : out;
+
+      if ((1 != EVP_DecryptUpdate (worker.m_cipher_ctx, dest, &out_len, worker.m_gather, gather_size)) ||
+          (out_len != gather_size))
+      {
+         return HC_ERROR_CANNOT_DECRYPT_SECTION;
+      }
+
+      if (partial)
+      {
+         memcpy (out, worker.m_gather, out_size);
+         out_size = gather_size;
+      }
+
+      out += gather_size;
+      out_size -= gather_size;
+      chunk_count -= gather_chunks;
+   }
+
+   return HC_STATUS_OK;
+}
+
+// Decrypt chunk_count chunks of the segment in ib, starting at first_chunk, into out.  With CBC, a chunk only needs
+// the cipher text of the chunk before it, so any range of chunks can be decrypted on its own.
+int HcEnginePrivate::decryptChunks (Worker& worker, HcKeyData& key_data, uint8_t* ib, uint32_t first_chunk, uint32_t chunk_count, uint8_t* out,
+                                    size_t out_size)
+{
+   HcShuffler* shuffler = getShuffler (key_data, worker);
+
+   if (!shuffler)
+   {
+      return HC_INTERNAL_ERROR_CANNOT_SET_LFSR_SPEC;
+   }
+
+   const HcCipherScheme* scheme = find_cipher_scheme (key_data.m_cipher);
+   uint8_t iv[sizeof (key_data.m_iv)];
+
+   if (!scheme)
+   {
+      return HC_INTERNAL_ERROR_CANNOT_INIT_CIPHER;
+   }
+
+   // A scheme that cannot seek is chained like CBC.
+   bool cbc = !scheme->m_seek;
+
+   if (cbc)
+   {
+      memcpy (iv, key_data.m_iv, sizeof (iv));
+   }
+   else if (!scheme->m_seek (key_data.m_iv, first_chunk, iv))
+   {
+      return HC_INTERNAL_ERROR_CANNOT_INIT_CIPHER;
+   }
+
+   if (!shuffler->start (key_data.m_in_size, (cbc && first_chunk) ? first_chunk - 1 : first_chunk))
+   {
+      return HC_INTERNAL_ERROR_BAD_LFSR_FILL;
+   }
+
+   // With CBC, the IV of the range is the last cipher block of the chunk before it.
+   if (cbc && first_chunk)
+   {
+      HcChunkMap map;
+
+      if (!shuffler->next (ib, map))
+      {
+         return HC_INTERNAL_ERROR_BAD_LFSR_FILL;
+      }
+
+      for (uint32_t i = 0; i < sizeof (iv); ++i)
+      {
+         uint32_t index = CHUNK_SIZE - sizeof (iv) + i;
+
+         iv[i] = map.m_base [(map.m_last && (CHUNK_SIZE - 1 == index)) ? 0 : map.m_indices [index * map.m_stride]];
+      }
+   }
+
+   if (!initCipher (worker, key_data, iv, 0))
+   {
+      return HC_INTERNAL_ERROR_CANNOT_INIT_CIPHER;
+   }
+
+   while (chunk_count)
+   {
+      uint32_t run_chunks = CRYPTO_RUN_SIZE / CHUNK_SIZE;
+
+      if (run_chunks > chunk_count)
+      {
+         run_chunks = chunk_count;
+      }
+
+      size_t run_size = std::min (out_size, (size_t) run_chunks * CHUNK_SIZE);
+      int status = gatherDecrypt (worker, shuffler, ib, out, run_chunks, run_size);
+
+      if (HC_STATUS_OK != status)
+      {
+         return status;
+      }
+
+      out += run_size;
+      out_size -= run_size;
+      chunk_count -= run_chunks;
+   }
+
+   return finishCipher (worker, key_data, 0);
+}
+
+// Decrypt the next segment.  Return the status.
+int HcEnginePrivate::decryptSegment (HcKeyData& key_data)
+{
+   if (!check_segment_key (key_data))
+   {
+      return HC_ERROR_BAD_KEY;
+   }
+
+   if ((size_t) key_data.m_out_size > m_buffer.size ())
+   {
+      return HC_INTERNAL_ERROR_BAD_TEMP_BUFFER;
+   }
+
+   int status = readInput (&m_buffer[0], key_data.m_out_size);
+
+   if (HC_STATUS_OK != status)
+   {
+      return status;
+   }
+
+   uint8_t* ib = &m_buffer[0];
+   uint32_t is = key_data.m_in_size;
+
+   HC_CALLBACK(HC_STATUS_DECRYPT_SECTION_START, 0);
+
+   Worker& worker = *m_workers[0];
+   HcShuffler* shuffler = getShuffler (key_data, worker);
+   size_t staging_size = m_plain_buffer.size ();
+   size_t staged = 0;
+
+   if (!shuffler)
+   {
+      return HC_INTERNAL_ERROR_CANNOT_SET_LFSR_SPEC;
+   }
+
+   if (!shuffler->start (is, 0))
+   {
+      return HC_INTERNAL_ERROR_BAD_LFSR_FILL;
+   }
+
+   if (!initCipher (worker, key_data, key_data.m_iv, 0))
+   {
+      return HC_INTERNAL_ERROR_CANNOT_INIT_CIPHER;
+   }
+
+   double progress = 0;
+   double progress_inc = (double) CRYPTO_RUN_SIZE * 100.0 / (double)is;
+   double old_progress = 0;
+
+   while (is)
+   {
+      uint32_t run = CRYPTO_RUN_SIZE;
+
+      if (run > is)
+      {
+         run = is;
+      }
+
+      status = gatherDecrypt (worker, shuffler, ib, &m_plain_buffer[staged], (run + CHUNK_SIZE - 1) / CHUNK_SIZE, run);
+
+      if (HC_STATUS_OK != status)
+      {
+         return status;
+      }
+
+      staged += run;
+      is -= run;
+
+      // The runs are decrypted into a staging buffer, which goes to the writer when full.
+      if (!is || (staged + CRYPTO_RUN_SIZE > staging_size))
+      {
+         status = writeBehind (m_plain_buffer, staged);
+
+         if (HC_STATUS_OK != status)
+         {
+            return status;
+         }
+
+         staged = 0;
+      }
+
+      progress += progress_inc;
+
+      if ((progress - old_progress) >= 5.0)
+      {
+         HC_CALLBACK(HC_STATUS_DECRYPT_SECTION_PROGRESS, progress);
+         old_progress = progress;
+      }
+   }
+
+   // With a tag, this is where a corrupted segment is caught.
+   status = finishCipher (worker, key_data, 0);
+
+   if (HC_STATUS_OK != status)
+   {
+      return status;
+   }
+
+   HC_CALLBACK(HC_STATUS_DECRYPT_SECTION_PROGRESS, 100);
+   HC_CALLBACK(HC_STATUS_DECRYPT_SECTION_END, 0);
+
+   return HC_STATUS_OK;
+}
+
+// Read or write at an offset of a file without moving its position, so several threads can use it at once.
+static bool transfer_file_at (FILE* file, uint8_t* buffer, size_t size, uint64_t offset, bool write)
+{
+#ifdef _WIN32
+   HANDLE handle = (HANDLE) _get_osfhandle (_fileno (file));
+
+   while (size)
+   {
+      OVERLAPPED overlapped;
+      DWORD part = (size > 0x40000000) ? 0x40000000 : (DWORD) size;
+      DWORD done = 0;
+
+      memset (&overlapped, 0, sizeof (overlapped));
+      overlapped.Offset = (DWORD) offset;
+      overlapped.OffsetHigh = (DWORD) (offset >> 32);
+
+      if (!(write ? WriteFile (handle, buffer, part, &done, &overlapped) : ReadFile (handle, buffer, part, &done, &overlapped)) || !done)
+      {
+         return false;
+      }
+
+      buffer += done;
+      size -= done;
+      offset += done;
+   }
+#else
+   int fd = fileno (file);
+
+   while (size)
+   {
+      ssize_t done = write ? pwrite (fd, buffer, size, (off_t) offset) : pread (fd, buffer, size, (off_t) offset);
 
-      for (uint8_t i = 1; i < max_index; ++i)
+      if (done <= 0)
       {
-         std::uniform_int_distribution<int> dist(i, max_index);
-
-         int index = dist(gen);
+         if ((done < 0) && (EINTR == errno))
+         {
+            continue;
+         }
 
-         HcKeyData d = m_key[i - 1];
-         m_key[i - 1] = m_key[index];
-         m_key[index] = d;
+         return false;
       }
+
+      buffer += done;
+      size -= (size_t) done;
+      offset += (uint64_t) done;
    }
+#endif
 
-   HC_CALLBACK (HC_STATUS_KEY_CREATION_PROGRESS, 100);
+   return true;
+}
 
-   return HC_STATUS_OK;
+// Whether in_size bytes of input are read and written around the system cache.
+bool HcEnginePrivate::usesDirectIo (uint64_t in_size)
+{
+   return (HC_IO_DIRECT == m_io_mode) || ((HC_IO_DEFAULT == m_io_mode) && (in_size >= DIRECT_IO_THRESHOLD));
 }
 
-// Encrypt the next segment.  Return the status.
-int HcEnginePrivate::encryptSegment (HcKeyData& key_data)
+/*
+   Open the input and output files again around the system cache, when the I/O mode asks for it or, by default, when
+   in_size bytes of input are too many to go through the cache.  The files that cannot be opened that way are read
+   and written at their offsets the default way.
+*/
+void HcEnginePrivate::openDirectFiles (uint64_t in_size)
 {
-   if (!key_data.m_in_size || (key_data.m_out_size < key_data.m_in_size))
+   m_direct_io = usesDirectIo (in_size);
+
+   if (!m_direct_io)
    {
-      return HC_INTERNAL_ERROR_INVALID_INPUT_SEGMENT_SIZE;
+      return;
    }
 
-   if ((m_in_file_index >= m_in_files.size()) || !m_in_files[m_in_file_index].m_file)
+   for (auto& f : m_in_files)
    {
-      return HC_ERROR_INVALID_INPUT_FILE;
+      f.m_direct.open (f.m_file, f.m_file_name.c_str (), false);
    }
 
-   if ((m_out_file_index >= m_out_files.size()) || !m_out_files[m_out_file_index].m_file)
+   for (auto& f : m_out_files)
    {
-      return HC_ERROR_INVALID_OUTPUT_FILE;
+      f.m_direct.open (f.m_file, f.m_temp_file_name.c_str (), true);
    }
+}
 
-   if (!m_lfsr)
+void HcEnginePrivate::closeDirectFiles (void)
+{
+   for (auto& f : m_in_files)
    {
-      return HC_INTERNAL_ERROR_BAD_LFSR;
+      f.m_direct.close ();
    }
 
-   if (!m_lfsr->setSpec (key_data.m_lfsr_specs))
+   for (auto& f : m_out_files)
    {
-      return HC_INTERNAL_ERROR_CANNOT_SET_LFSR_SPEC;
+      f.m_direct.close ();
    }
 
-   HC_CALLBACK (HC_STATUS_ENCRYPT_SECTION_START, 0);
+   m_direct_io = false;
+}
 
-   if ((size_t) key_data.m_out_size > m_buffer.size ())
+// Map all the input and output files, the outputs at their full size.  If any of them cannot be, none are.
+bool HcEnginePrivate::mapFiles (void)
+{
+   for (auto& f : m_in_files)
    {
-      return HC_INTERNAL_ERROR_BAD_TEMP_BUFFER;
+      if (!f.m_map.map (f.m_file, f.m_size, false))
+      {
+         unmapFiles ();
+         return false;
+      }
    }
 
-   uint8_t* ob = &m_buffer[0];
-
-   // If there is a chance that a slot in the output is not going to be filled, fill the whole output buffer with random numbers.
-   if (key_data.m_out_size != key_data.m_in_size)
+   for (auto& f : m_out_files)
    {
-      randFill (ob, key_data.m_out_size);
+      if (!f.m_map.map (f.m_file, f.m_size, true))
+      {
+         unmapFiles ();
+         return false;
+      }
    }
 
-   uint32_t is = key_data.m_in_size;
-
-   uint32_t chunk_size = 256;
-   std::vector<uint32_t> indices;
-   std::vector<uint8_t> in_buf;
-
-   indices.resize (chunk_size);
-   in_buf.resize (chunk_size);
-
-   AES_KEY aes_key;
-
-   AES_set_encrypt_key (key_data.m_key, 256, &aes_key);
-
-   std::vector<uint8_t> ivec;
-   ivec.resize (sizeof (key_data.m_iv));
-
-   memcpy (&ivec[0], key_data.m_iv, ivec.size ());
-
-   double progress = 0;
-   double progress_inc = 256.0 * 100.0 / (double) is;
-   double old_progress = 0;
+   return true;
+}
 
-   while (is)
+void HcEnginePrivate::unmapFiles (void)
+{
+   for (auto& f : m_in_files)
    {
-      uint32_t chunk = chunk_size;
+      f.m_map.unmap ();
+   }
 
-      if (chunk > is)
-      {
-         chunk = is;
-      }
+   for (auto& f : m_out_files)
+   {
+      f.m_map.unmap ();
+   }
+}
 
-      // If the last chunk is less than the minimum chunk size, pad with randoms.
-      if (chunk < chunk_size)
+// Get the mapped bytes at offset of files laid end to end, if all size of them are in one mapped file.
+uint8_t* HcEnginePrivate::mappedAt (std::vector<FileSpec>& files, size_t size, uint64_t offset)
+{
+   for (auto& f : files)
+   {
+      if (offset >= f.m_size)
       {
-         randFill (&in_buf[chunk], chunk_size - chunk);
+         offset -= f.m_size;
+         continue;
       }
 
-      if (1 != fread (&in_buf[0], chunk, 1, m_in_files[m_in_file_index].m_file))
+      if (!f.m_map.getData () || (offset + size > f.m_size))
       {
-         return HC_ERROR_CANNOT_READ_INPUT_FILE;
+         return 0;
       }
 
-      is -= chunk;
+      return f.m_map.getData () + offset;
+   }
 
-      AES_cbc_encrypt ((const unsigned char*) &in_buf[0], (unsigned char*) &in_buf[0], chunk_size, &aes_key, &ivec[0], 1);
+   return 0;
+}
 
-      if (!m_lfsr->fillNext (&indices[0], chunk_size))
+// Read or write size bytes at offset of files laid end to end, like the splits of an encrypted file.
+bool HcEnginePrivate::transferAt (std::vector<FileSpec>& files, uint8_t* buffer, size_t size, uint64_t offset, bool write, int group)
+{
+   for (auto& f : files)
+   {
+      if (!size)
       {
-         return HC_INTERNAL_ERROR_BAD_LFSR_FILL;
+         break;
       }
 
-      for (uint32_t i = 0; i < chunk_size - 1; ++i)
+      if (offset >= f.m_size)
       {
-         ob[indices[i]] = in_buf[i];
+         offset -= f.m_size;
+         continue;
       }
 
-      // If this is the last chunk in the segment, the last byte should go into index 0 since index 0 is never generated by the LFSR.
-      ob[is ? indices[chunk_size - 1] : 0] = in_buf[chunk_size - 1];
+      size_t part = (size_t) std::min ((uint64_t) size, (uint64_t) f.m_size - offset);
 
-      progress += progress_inc;
-
-      if ((progress - old_progress) >= 5.0)
+      if (!f.m_file)
       {
-         HC_CALLBACK (HC_STATUS_ENCRYPT_SECTION_PROGRESS, progress);
-         old_progress = progress;
+         return false;
       }
-   }
 
-   size_t bytes_to_write = key_data.m_out_size;
-
-   // While there are bytes to write for this segment...
-   while (bytes_to_write)
-   {
-      if (m_out_file_index >= m_out_files.size ())
+      // A mapped file is copied to or from, and with a group, the transfer is only started on the io_uring.
+      if (f.m_map.getData ())
       {
-         return HC_ERROR_CANNOT_WRITE_OUTPUT_FILE;
+         write ? memcpy (f.m_map.getData () + offset, buffer, part) : memcpy (buffer, f.m_map.getData () + offset, part);
       }
-
-      size_t chunk = bytes_to_write;
-
-      // If the segment size is larger than the max file size...
-      if (chunk > m_out_files[m_out_file_index].m_size)
+      else if (f.m_direct.isOpen ())
       {
-         chunk = m_out_files[m_out_file_index].m_size;
+         if (!f.m_direct.transfer (buffer, part, offset, write))
+         {
+            return false;
+         }
       }
-
-      // Write what we can write for now.
-      if (1 != fwrite (ob, chunk, 1, m_out_files[m_out_file_index].m_file))
+      else if ((group < 0) ? !transfer_file_at (f.m_file, buffer, part, offset, write) :
+                        !m_uring.submit ((unsigned int) group, fileno (f.m_file), buffer, part, offset, write))
       {
-         return HC_ERROR_CANNOT_WRITE_OUTPUT_FILE;
+         return false;
       }
 
-      m_out_files[m_out_file_index].m_size -= chunk;
-      bytes_to_write -= chunk;
-      ob += chunk;
-
-      // If we reached the max file size...
-      if (!m_out_files[m_out_file_index].m_size)
-      {
-         // Close this file since we are done with it.
-         fclose (m_out_files[m_out_file_index].m_file);
-         m_out_files[m_out_file_index].m_file = 0;
-
-         ++m_out_file_index;
-      }
+      buffer += part;
+      size -= part;
+      offset = 0;
    }
 
-   HC_CALLBACK (HC_STATUS_ENCRYPT_SECTION_PROGRESS, 100);
-   HC_CALLBACK (HC_STATUS_ENCRYPT_SECTION_END, 0);
-
-   return HC_STATUS_OK;
+   return !size;
 }
 
-// Encrypt a file.
-int HcEnginePrivate::encryptFile (const char* in_file_path, uint32_t splits)
+// Get the index of the file that holds offset of files laid end to end.
+size_t HcEnginePrivate::fileAt (std::vector<FileSpec>& files, uint64_t offset)
 {
-   if (!in_file_path || !in_file_path[0])
+   size_t index = 0;
+
+   while ((index + 1 < files.size ()) && (offset >= files[index].m_size))
    {
-      return HC_ERROR_BAD_INPUT_FILE_NAME;
+      offset -= files[index++].m_size;
    }
 
-   HC_CALLBACK(HC_STATUS_ENCRYPT_START, 0);
-
-   boost::filesystem::path in_path(in_file_path);
-
-   std::string in_file_name = in_path.filename().generic_string();
-
-   m_key_file.clear ();
-
-   std::string key_file_name = in_file_name + ".hckey";
+   return index;
+}
 
-   if (boost::filesystem::exists(key_file_name))
+/*
+   Encrypt a segment whose plain text is at in_offset of the input, and write it at out_offset of the output.  The
+   worker encrypts the segment on its own, in its own buffers, so other segments can be encrypted at the same time.
+   With split, the segment is spread over all the threads of the pool instead.
+*/
+int HcEnginePrivate::encryptSegmentAt (Worker& worker, HcKeyData& key_data, uint64_t in_offset, uint64_t out_offset, bool split)
+{
+   if (!key_data.m_in_size || (key_data.m_out_size < key_data.m_in_size))
    {
-      return HC_ERROR_KEY_FILE_ALREADY_EXISTS;
+      return HC_INTERNAL_ERROR_INVALID_INPUT_SEGMENT_SIZE;
    }
 
-   m_key_file.m_file_name = key_file_name;
-   m_key_file.m_temp_file_name = getTempFileName () + "-hctemp";
+   std::vector<uint8_t>& plain = split ? m_plain_buffer : worker.m_plain;
+   std::vector<uint8_t>& segment = split ? m_buffer : worker.m_segment;
+   uint32_t is = key_data.m_in_size;
+   uint32_t chunk_count = (is + CHUNK_SIZE - 1) / CHUNK_SIZE;
 
-   m_out_files.clear();
-   m_out_file_index = 0;
+   // A mapped output is scattered into in place, unless the segment is over two of its splits.
+   uint8_t* ob = mappedAt (m_out_files, key_data.m_out_size, out_offset);
+   bool mapped = (0 != ob);
 
-   if (splits)
+   try
    {
-      char temp[64];
-
-      FileSpec fs;
-
-      fs.m_file = 0;
-      fs.m_size = 0;
+      plain.resize ((size_t) chunk_count * CHUNK_SIZE);
 
-	  // If the output file is to be split, generate the output file names.
-      for (size_t i = 0; i < splits; ++i)
+      if (!mapped && (segment.size () < key_data.m_out_size))
       {
-         fs.m_file_name = in_file_name;
-         sprintf (temp, ".%02d.hc", i + 1);
-         fs.m_file_name += temp;
-
-         if (boost::filesystem::exists(fs.m_file_name))
-         {
-            m_out_files.clear ();
-            return HC_ERROR_OUTPUT_FILE_ALREADY_EXISTS;
-         }
-
-         m_out_files.push_back (fs);
+         segment.resize (key_data.m_out_size);
       }
    }
-   else
+   catch (...)
    {
-      FileSpec fs;
-
-      fs.m_file = 0;
-      fs.m_size = 0;
+      return HC_ERROR_BLOCK_SIZE_TOO_BIG;
+   }
 
-      fs.m_file_name = in_file_name;
-      fs.m_file_name += ".hc";
+   if (!mapped)
+   {
+      ob = &segment[0];
+   }
 
-      if (boost::filesystem::exists(fs.m_file_name))
-      {
-         m_out_files.clear ();
-         return HC_ERROR_OUTPUT_FILE_ALREADY_EXISTS;
-      }
+   HC_CALLBACK (HC_STATUS_ENCRYPT_SECTION_START, 0);
 
-      m_out_files.push_back (fs);
+   // If the last chunk is less than the minimum chunk size, pad with randoms.
+   if (is < chunk_count * CHUNK_SIZE)
+   {
+      randFill (&plain[is], chunk_count * CHUNK_SIZE - is);
    }
 
-   for (auto& e : m_out_files)
+   if (!transferAt (m_in_files, &plain[0], is, in_offset, false))
    {
-      e.m_temp_file_name = getTempFileName () + "-hctemp";
+      return HC_ERROR_CANNOT_READ_INPUT_FILE;
    }
 
-   if (!boost::filesystem::exists (in_file_path))
+   // If there is a chance that a slot in the output is not going to be filled, fill the whole output buffer with random numbers.
+   if (key_data.m_out_size != key_data.m_in_size)
    {
-      return HC_ERROR_CANNOT_OPEN_INPUT_FILE;
+      randFill (ob, key_data.m_out_size);
    }
 
-   size_t file_size = 0;
-   
-   try
+   int status = HC_STATUS_OK;
+
+   if (split)
    {
-	   file_size = boost::filesystem::file_size(in_file_path);
+      uint32_t threads = (uint32_t) m_workers.size ();
+      std::vector<int> statuses (threads, HC_STATUS_OK);
 
-	   if (!file_size)
-	   {
-		   throw;
-	   }
+      m_pool->run (threads, [&] (unsigned int t)
+      {
+         uint32_t first = (uint32_t) ((uint64_t) chunk_count * t / threads);
+         uint32_t last = (uint32_t) ((uint64_t) chunk_count * (t + 1) / threads);
+
+         statuses[t] = encryptChunks (*m_workers[t], key_data, &plain[(size_t) first * CHUNK_SIZE], first, last - first, ob);
+      });
+
+      for (auto& st : statuses)
+      {
+         if (HC_STATUS_OK != st)
+         {
+            status = st;
+         }
+      }
    }
-   catch (...)
+   else
    {
-	   return HC_ERROR_CANNOT_OPEN_INPUT_FILE;
+      status = encryptChunks (worker, key_data, &plain[0], 0, chunk_count, ob);
    }
 
-   FileSpec in_file_spec;
-
-   in_file_spec.m_file = fopen (in_file_path, "rb");
-   
-   if (!in_file_spec.m_file)
+   if (HC_STATUS_OK != status)
    {
-      return HC_ERROR_CANNOT_OPEN_INPUT_FILE;
+      return status;
    }
 
-   m_in_files.clear();
-   m_in_file_index = 0;
-
-   in_file_spec.m_size = file_size;
-
-   m_in_files.push_back (in_file_spec);
-
-   HC_CALLBACK (HC_STATUS_KEY_CREATION_START, 0);
+   if (!mapped && !transferAt (m_out_files, ob, key_data.m_out_size, out_offset, true))
+   {
+      return HC_ERROR_CANNOT_WRITE_OUTPUT_FILE;
+   }
 
-   // Create the LFSR.
-   m_lfsr = new HcLfsr (0);
+   HC_CALLBACK (HC_STATUS_ENCRYPT_SECTION_END, 0);
 
-   int status = generateKey (file_size);
+   return HC_STATUS_OK;
+}
 
-   if (HC_STATUS_OK != status)
+// Decrypt a segment whose cipher text is at in_offset of the input, and write it at out_offset of the output.  Like
+// encryptSegmentAt, the worker decrypts it on its own, unless it is split over all the threads.
+int HcEnginePrivate::decryptSegmentAt (Worker& worker, HcKeyData& key_data, uint64_t in_offset, uint64_t out_offset, bool split)
+{
+   if (!check_segment_key (key_data))
    {
-      return status;
+      return HC_ERROR_BAD_KEY;
    }
 
-   HC_CALLBACK (HC_STATUS_KEY_CREATION_END, 0);
+   std::vector<uint8_t>& plain = split ? m_plain_buffer : worker.m_plain;
+   std::vector<uint8_t>& segment = split ? m_buffer : worker.m_segment;
+   uint32_t is = key_data.m_in_size;
+   uint32_t chunk_count = (is + CHUNK_SIZE - 1) / CHUNK_SIZE;
 
-   size_t total_out_size = 0;
-   size_t max_segment_size = 0;
+   // Mapped files are gathered from and decrypted into in place, unless the segment is over two splits.
+   uint8_t* ib = mappedAt (m_in_files, key_data.m_out_size, in_offset);
+   uint8_t* out = mappedAt (m_out_files, is, out_offset);
+   bool mapped_in = (0 != ib);
+   bool mapped_out = (0 != out);
 
-   // Calculate the expected output file size.
-   for (auto& ke : m_key)
+   try
    {
-      if (max_segment_size < ke.m_out_size)
+      if (!mapped_out)
       {
-         max_segment_size = ke.m_out_size;
+         plain.resize ((size_t) chunk_count * CHUNK_SIZE);
+         out = &plain[0];
       }
-      total_out_size += ke.m_out_size;
-   }
 
-   try
-   {
-      m_buffer.resize (max_segment_size);
+      if (!mapped_in && (segment.size () < key_data.m_out_size))
+      {
+         segment.resize (key_data.m_out_size);
+      }
    }
    catch (...)
    {
+      return HC_ERROR_BLOCK_SIZE_TOO_BIG;
    }
 
-   if (m_buffer.size () != max_segment_size)
+   HC_CALLBACK (HC_STATUS_DECRYPT_SECTION_START, 0);
+
+   if (!mapped_in)
    {
-      return HC_ERROR_BLOCK_SIZE_TOO_BIG;
+      ib = &segment[0];
+
+      if (!transferAt (m_in_files, ib, key_data.m_out_size, in_offset, false))
+      {
+         return HC_ERROR_CANNOT_READ_INPUT_FILE;
+      }
    }
 
-   if (splits)
+   int status = HC_STATUS_OK;
+
+   if (split)
    {
-	   // The output file size must be at least the size of the smallest LFSR sequence.
-      if (total_out_size < HcLfsr::getMinSize())
-      {
-         return HC_ERROR_BAD_KEY;
-      }
+      uint32_t threads = (uint32_t) m_workers.size ();
+      std::vector<int> statuses (threads, HC_STATUS_OK);
 
-	  uintmax_t chunk_size = total_out_size / splits;
+      m_pool->run (threads, [&] (unsigned int t)
+      {
+         uint32_t first = (uint32_t) ((uint64_t) chunk_count * t / threads);
+         uint32_t last = (uint32_t) ((uint64_t) chunk_count * (t + 1) / threads);
 
-	  // Make sure the splits happen at a 256-byte boundary.
-	  if (chunk_size & 0xFF)
-	  {
-		  chunk_size = (chunk_size & ~0xFF) + 0x100;
-	  }
+         size_t offset = (size_t) first * CHUNK_SIZE;
 
-      size_t temp = total_out_size;
+         statuses[t] = decryptChunks (*m_workers[t], key_data, ib, first, last - first, out + offset,
+                                      std::min ((size_t) (last - first) * CHUNK_SIZE, (size_t) is - offset));
+      });
 
-      // Set the size of each split.
-	  for (size_t i = 0; i < m_out_files.size (); ++i)
+      for (auto& st : statuses)
       {
-         m_out_files[i].m_size = (temp > chunk_size) ? chunk_size : temp;
-         temp -= m_out_files[i].m_size;
+         if (HC_STATUS_OK != st)
+         {
+            status = st;
+         }
       }
    }
    else
    {
-      m_out_files[0].m_size = total_out_size;
+      status = decryptChunks (worker, key_data, ib, 0, chunk_count, out, is);
    }
 
-   // Open all the output files for writing.
-   for (auto& e : m_out_files)
+   // With a tag, this is where a corrupted segment is caught.
+   if (HC_STATUS_OK != status)
    {
-      e.m_file = fopen (e.m_temp_file_name.c_str (), "wb");
+      return status;
+   }
 
-      if (!e.m_file)
-      {
-         return HC_ERROR_CANNOT_CREATE_OUTPUT_FILE;
-      }
+   if (!mapped_out && !transferAt (m_out_files, out, is, out_offset, true))
+   {
+      return HC_ERROR_CANNOT_WRITE_OUTPUT_FILE;
    }
 
-   size_t progress = 0;
+   HC_CALLBACK (HC_STATUS_DECRYPT_SECTION_END, 0);
 
-   HC_CALLBACK (HC_STATUS_ENCRYPT_PROGRESS, 0);
+   return HC_STATUS_OK;
+}
 
-   // Encrypt all the segments
-   for (auto& ke : m_key)
+// Encrypt or decrypt segments on a thread, taking the next one from the list until none is left.
+int HcEnginePrivate::runSegments (unsigned int thread, const std::vector<size_t>& segments, std::atomic<size_t>& next,
+                                  const std::vector<uint64_t>& in_offsets, const std::vector<uint64_t>& out_offsets, int enc,
+                                  std::atomic<uint64_t>& progress, uint64_t total)
+{
+   Worker& worker = *m_workers[thread];
+
+   for (size_t i = next++; i < segments.size (); i = next++)
    {
-      HcKeyData kd = ke;
+      size_t k = segments[i];
+      HcKeyData& key_data = m_key[k];
 
-      int status = encryptSegment (kd);
+      int status = enc ? encryptSegmentAt (worker, key_data, in_offsets[k], out_offsets[k], false) :
+                         decryptSegmentAt (worker, key_data, in_offsets[k], out_offsets[k], false);
 
       if (HC_STATUS_OK != status)
       {
+         // Stop the other threads too.
+         next = segments.size ();
          return status;
       }
 
-      progress += ke.m_out_size;
+      uint64_t done = (progress += key_data.m_in_size);
 
-      HC_CALLBACK (HC_STATUS_ENCRYPT_PROGRESS, ((double)progress * 100.0 / (double)total_out_size));
+      HC_CALLBACK (enc ? HC_STATUS_ENCRYPT_PROGRESS : HC_STATUS_DECRYPT_PROGRESS, ((double) done * 100.0 / (double) total));
    }
 
-   HC_CALLBACK (HC_STATUS_ENCRYPT_PROGRESS, 100);
-
-   if (m_key.empty ())
-   {
-      return HC_ERROR_BAD_KEY;
-   }
+   return HC_STATUS_OK;
+}
 
-   // Create the key file.
-   int result = keyToXmlFile (m_key_file.m_temp_file_name.c_str ());
+// Reorder the segments so they take turns between their groups, each group keeping its own order.
+static void stripe_segments (std::vector<size_t>& segments, const std::vector<size_t>& groups)
+{
+   std::vector<std::vector<size_t>> grouped;
+   size_t most = 0;
 
-   if (HC_STATUS_OK != result)
+   for (auto k : segments)
    {
-      return result;
-   }
+      if (groups[k] >= grouped.size ())
+      {
+         grouped.resize (groups[k] + 1);
+      }
 
-   // After the temp output files and temp key file have been written succuessfuly, rename them to the actual file names.
-   // This is used so that no partial files and left over in case an error happens in the middle of the operation.
-   if (rename (m_key_file.m_temp_file_name.c_str (), m_key_file.m_file_name.c_str ()) < 0)
-   {
-      return HC_ERROR_CANNOT_WRITE_KEY_FILE;
+      grouped[groups[k]].push_back (k);
+      most = std::max (most, grouped[groups[k]].size ());
    }
 
-   for (auto& e : m_out_files)
+   segments.clear ();
+
+   for (size_t i = 0; i < most; ++i)
    {
-      if (rename (e.m_temp_file_name.c_str (), e.m_file_name.c_str ()) < 0)
+      for (auto& g : grouped)
       {
-         return HC_ERROR_CANNOT_WRITE_OUTPUT_FILE;
+         if (i < g.size ())
+         {
+            segments.push_back (g[i]);
+         }
       }
    }
-
-   for (auto& e : m_out_files)
-   {
-      e.clear ();
-   }
-
-   m_key_file.clear ();
-
-   cleanUp ();
-
-   HC_CALLBACK (HC_STATUS_ENCRYPT_END, 0);
-
-   return HC_STATUS_OK;
 }
 
-// Decrypt the next segment.  Return the status.
-int HcEnginePrivate::decryptSegment (HcKeyData& key_data)
+/*
+   Encrypt or decrypt all the segments over the threads of the pool.  The segments are independent, and where each
+   one goes in the input and the output only depends on the sizes of the ones before it, so they are read and written
+   at their offsets in any order.  Segments big enough to be split are done one at a time by all the threads.  The
+   others are done side by side, one per thread, biggest first so the threads finish about together.  The segments of
+   a split file take turns between its parts instead, and are not split, so all the parts are written or read at once.
+*/
+int HcEnginePrivate::runParallel (int enc)
 {
-   if (!m_lfsr->setSpec (key_data.m_lfsr_specs))
+   size_t count = m_key.size ();
+   uint32_t threads = (uint32_t) m_workers.size ();
+   std::vector<uint64_t> in_offsets (count);
+   std::vector<uint64_t> out_offsets (count);
+   std::vector<size_t> order (count);
+   std::vector<size_t> split;
+   std::vector<size_t> single;
+   uint64_t plain_size = 0;
+   uint64_t cipher_size = 0;
+   std::vector<FileSpec>& parts = enc ? m_out_files : m_in_files;
+   bool striped = (parts.size () > 1) && (count >= threads);
+
+   for (size_t k = 0; k < count; ++k)
    {
-      return HC_INTERNAL_ERROR_CANNOT_SET_LFSR_SPEC;
+      in_offsets[k] = enc ? plain_size : cipher_size;
+      out_offsets[k] = enc ? cipher_size : plain_size;
+      plain_size += m_key[k].m_in_size;
+      cipher_size += m_key[k].m_out_size;
+      order[k] = k;
    }
 
-   if (key_data.m_in_size > key_data.m_out_size)
+   std::stable_sort (order.begin (), order.end (), [&] (size_t a, size_t b)
    {
-      return HC_ERROR_BAD_KEY;
-   }
+      return m_key[a].m_out_size > m_key[b].m_out_size;
+   });
 
-   if (!key_data.m_in_size)
+   for (auto k : order)
    {
-	   return HC_ERROR_BAD_KEY;
-   }
+      uint32_t chunk_count = (m_key[k].m_in_size + CHUNK_SIZE - 1) / CHUNK_SIZE;
 
-   size_t bytes_to_read = key_data.m_out_size;
-   size_t bytes_read = 0;
-
-   while (bytes_to_read)
-   {
-      if (m_in_file_index >= m_in_files.size ())
+      if ((threads > 1) && !striped && can_split (find_cipher_scheme (m_key[k].m_cipher), enc) && (chunk_count >= threads * (CRYPTO_RUN_SIZE / CHUNK_SIZE)))
       {
-         return HC_ERROR_CANNOT_READ_INPUT_FILE;
+         split.push_back (k);
       }
-
-      size_t res = fread (&m_buffer[bytes_read], 1, bytes_to_read, m_in_files [m_in_file_index].m_file);
-
-      if (res != bytes_to_read)
+      else
       {
-         ++m_in_file_index;
+         single.push_back (k);
       }
+   }
 
-      bytes_to_read -= res;
-      bytes_read += res;
-   };
-
-   uint8_t* ib = &m_buffer[0];
-   uint32_t is = key_data.m_in_size;
-
-   uint32_t chunk_size = 256;
-   std::vector<uint32_t> indices;
-   std::vector<uint8_t> out_buf;
-
-   indices.resize (chunk_size);
-   out_buf.resize (chunk_size);
-
-   AES_KEY aes_key;
-
-   AES_set_decrypt_key (key_data.m_key, 256, &aes_key);
+   if (striped)
+   {
+      std::vector<size_t> segment_parts (count);
 
-   std::vector<uint8_t> ivec;
-   ivec.resize (sizeof (key_data.m_iv));
+      for (size_t k = 0; k < count; ++k)
+      {
+         segment_parts[k] = fileAt (parts, enc ? out_offsets[k] : in_offsets[k]);
+      }
 
-   memcpy (&ivec[0], key_data.m_iv, ivec.size ());
+      stripe_segments (single, segment_parts);
+   }
 
-   HC_CALLBACK(HC_STATUS_DECRYPT_SECTION_START, 0);
+   std::atomic<uint64_t> progress (0);
 
-   double progress = 0;
-   double progress_inc = 256.0 * 100.0 / (double)is;
-   double old_progress = 0;
+   // When the files cannot be mapped, or do not fit in the memory budget, the segments are read and written at their
+   // offsets instead.
+   if ((HC_IO_MMAP == m_io_mode) && m_budget_map)
+   {
+      mapFiles ();
+   }
 
-   while (is)
+   for (auto k : split)
    {
-      uint32_t chunk = chunk_size;
+      int status = enc ? encryptSegmentAt (*m_workers[0], m_key[k], in_offsets[k], out_offsets[k], true) :
+                         decryptSegmentAt (*m_workers[0], m_key[k], in_offsets[k], out_offsets[k], true);
 
-      if (chunk > is)
+      if (HC_STATUS_OK != status)
       {
-         chunk = is;
+         return status;
       }
 
-      if (!m_lfsr->fillNext (&indices[0], chunk_size))
-      {
-         return HC_INTERNAL_ERROR_BAD_LFSR_FILL;
-      }
+      uint64_t done = (progress += m_key[k].m_in_size);
 
-      for (uint32_t i = 0; i < (chunk_size - 1); ++i)
-      {
-         out_buf[i] = ib [indices [i]];
-      }
+      HC_CALLBACK (enc ? HC_STATUS_ENCRYPT_PROGRESS : HC_STATUS_DECRYPT_PROGRESS, ((double) done * 100.0 / (double) plain_size));
+   }
+
+   // The memory budget may hold back how many segments are done side by side.
+   uint32_t side = std::max (std::min (threads, (uint32_t) m_budget_threads), (uint32_t) 1);
+   std::atomic<size_t> next (0);
+   std::vector<int> statuses (side, HC_STATUS_OK);
 
-      out_buf[chunk_size - 1] = ib [(is != chunk) ? indices [chunk_size - 1] : 0];
+   m_pool->run (side, [&] (unsigned int t)
+   {
+      statuses[t] = runSegments (t, single, next, in_offsets, out_offsets, enc, progress, plain_size);
+   });
 
-      AES_cbc_encrypt ((const unsigned char*) &out_buf[0], (unsigned char*) &out_buf[0], chunk_size, &aes_key, &ivec[0], 0);
+   unmapFiles ();
 
-      if (1 != fwrite (&out_buf[0], chunk, 1, m_out_files[0].m_file))
+   for (auto& st : statuses)
+   {
+      if (HC_STATUS_OK != st)
       {
-         return HC_ERROR_CANNOT_WRITE_OUTPUT_FILE;
+         return st;
       }
-
-      is -= chunk;
-
-	  progress += progress_inc;
-
-	  if ((progress - old_progress) >= 5.0)
-	  {
-		  HC_CALLBACK(HC_STATUS_DECRYPT_SECTION_PROGRESS, progress);
-		  old_progress = progress;
-	  }
    }
 
-   HC_CALLBACK(HC_STATUS_DECRYPT_SECTION_PROGRESS, 100);
-   HC_CALLBACK(HC_STATUS_DECRYPT_SECTION_END, 0);
-
    return HC_STATUS_OK;
 }
 
@@ -1111,15 +3606,15 @@ int HcEnginePrivate::decryptFile (const char* key_file_path, unsigned long joins
 
    FileSpec ofs;
 
-   ofs.m_file_name = boost::filesystem::basename (boost::filesystem::path (key_file_path));
+   ofs.m_file_name = getOutputFileName (boost::filesystem::basename (boost::filesystem::path (key_file_path)));
 
-   // Make sure the output file does not exist in the current dir.
+   // Make sure the output file does not exist in the output dir.
    if (boost::filesystem::exists(ofs.m_file_name))
    {
       return HC_ERROR_OUTPUT_FILE_ALREADY_EXISTS;
    }
 
-   ofs.m_temp_file_name = getTempFileName () + "-hctemp";
+   ofs.m_temp_file_name = getOutputFileName (getTempFileName ()) + "-hctemp";
 
    uintmax_t total_file_size = 0;
 
@@ -1145,7 +3640,9 @@ int HcEnginePrivate::decryptFile (const char* key_file_path, unsigned long joins
 
       FileSpec fs;
 
+      fs.m_file_name = fn;
       fs.m_file = fopen (fn.c_str(), "rb");
+      fs.m_size = total_file_size;
 
       if (!fs.m_file)
       {
@@ -1158,13 +3655,9 @@ int HcEnginePrivate::decryptFile (const char* key_file_path, unsigned long joins
    {
       for (uint32_t i = 0; i < joins; ++i)
       {
-         char temp[64];
-
-         sprintf (temp, ".%02d.hc", i + 1);
-
          FileSpec fs;
 
-         fs.m_file_name = ofs.m_file_name + temp;
+         fs.m_file_name = getSplitFileName (ofs.m_file_name, i);
 
          try
          {
@@ -1208,7 +3701,7 @@ int HcEnginePrivate::decryptFile (const char* key_file_path, unsigned long joins
 
    ofs.m_size = in_total_size;
 
-   ofs.m_file = fopen (ofs.m_temp_file_name.c_str (), "wb");
+   ofs.m_file = fopen (ofs.m_temp_file_name.c_str (), (HC_IO_MMAP == m_io_mode) ? "w+b" : "wb");
 
    if (!ofs.m_file)
    {
@@ -1217,36 +3710,144 @@ int HcEnginePrivate::decryptFile (const char* key_file_path, unsigned long joins
 
    m_out_files.push_back (ofs);
 
+   openDirectFiles (total_file_size);
+
    size_t progress = 0;
 
    HC_CALLBACK(HC_STATUS_DECRYPT_PROGRESS, 0);
 
-   for (auto& ke : m_key)
+   // With several threads, the segments are decrypted side by side, and mapped files are read at their offsets.
+   if (runsParallel ())
+   {
+      int status = runParallel (0);
+
+      if (HC_STATUS_OK != status)
+      {
+         return status;
+      }
+   }
+   else
    {
-      int status = decryptSegment (ke);
+      size_t staging_size = 0;
+
+      // The decrypted runs are staged up to OUTPUT_STAGING_SIZE, or the biggest segment when it is smaller.
+      for (auto& ke : m_key)
+      {
+         staging_size = std::max (staging_size, (size_t) ((ke.m_in_size + CHUNK_SIZE - 1) / CHUNK_SIZE) * CHUNK_SIZE);
+      }
+
+      staging_size = std::min (staging_size, (size_t) OUTPUT_STAGING_SIZE);
+
+      try
+      {
+         m_plain_buffer.resize (staging_size);
+      }
+      catch (...)
+      {
+         return HC_ERROR_BLOCK_SIZE_TOO_BIG;
+      }
+
+      // Joined parts are read at once, each in a stream of the segments that start in it, and the segments take turns
+      // between the streams.  The output is then written at the offsets of the segments.
+      std::vector<uint64_t> in_ends;
+      std::vector<uint64_t> out_offsets;
+      std::vector<size_t> streams;
+      std::vector<size_t> order;
+      uint64_t in_offset = 0;
+      uint64_t out_offset = 0;
+      size_t stream_part = 0;
+      size_t read_ahead = m_budget_read_ahead;
+
+      for (size_t k = 0; k < m_key.size (); ++k)
+      {
+         size_t part = fileAt (m_in_files, in_offset);
+
+         if (in_ends.empty () || ((part != stream_part) && m_budget_part_streams))
+         {
+            in_ends.push_back (in_offset);
+            stream_part = part;
+         }
+
+         in_offset += m_key[k].m_out_size;
+         in_ends.back () = in_offset;
+
+         out_offsets.push_back (out_offset);
+         out_offset += m_key[k].m_in_size;
+
+         streams.push_back (in_ends.size () - 1);
+         order.push_back (k);
+      }
+
+      stripe_segments (order, streams);
+
+      if (in_ends.size () > 1)
+      {
+         read_ahead = PART_READ_AHEAD_SIZE;
+
+         for (auto& ke : m_key)
+         {
+            read_ahead = std::max (read_ahead, (size_t) ke.m_out_size);
+         }
+      }
+
+      // The input is read and the output written on their own threads, while the segments are decrypted on this one.
+      int status = startStages (in_ends, read_ahead, m_budget_back_buffer ? staging_size : 0);
 
       if (HC_STATUS_OK != status)
       {
          return status;
       }
 
-		progress += ke.m_in_size;
+      for (auto k : order)
+      {
+         HcKeyData& ke = m_key[k];
+
+         m_read_stream = m_read_streams[streams[k]].get ();
+
+         if (m_transfer_at)
+         {
+            m_write_position = out_offsets[k];
+         }
+
+         status = decryptSegment (ke);
+
+         if (HC_STATUS_OK != status)
+         {
+            return status;
+         }
+
+         progress += ke.m_in_size;
+
+         HC_CALLBACK(HC_STATUS_DECRYPT_PROGRESS, ((double)progress * 100.0 / (double)in_total_size));
+      }
+
+      status = waitWrites ();
 
-		HC_CALLBACK(HC_STATUS_DECRYPT_PROGRESS, ((double)progress * 100.0 / (double)in_total_size));
+      if (HC_STATUS_OK != status)
+      {
+         return status;
+      }
    }
 
    HC_CALLBACK(HC_STATUS_DECRYPT_PROGRESS, 100);
 
-   fclose (m_out_files[0].m_file);
-   m_out_files[0].m_file = 0;
+   closeDirectFiles ();
+
+   // The writer closes the output file once it is full, unless it was written at its offsets.
+   if (m_out_files[0].m_file)
+   {
+      fclose (m_out_files[0].m_file);
+      m_out_files[0].m_file = 0;
+   }
 
-   if (rename (m_out_files[0].m_temp_file_name.c_str(), m_out_files[0].m_file_name.c_str()) < 0)
+   if (!renameTempFile (m_out_files[0]))
    {
       return HC_ERROR_CANNOT_WRITE_OUTPUT_FILE;
    }
 
    m_out_files[0].m_file_name.clear ();
    m_out_files[0].m_temp_file_name.clear ();
+   m_out_files[0].m_renamed = false;
 
    cleanUp ();
 
@@ -1262,10 +3863,18 @@ int HcEnginePrivate::decryptFile (const char* key_file_path, unsigned long joins
 #define XML_HC_IN_SIZE        "in_size"
 #define XML_HC_OUT_SIZE       "out_size"
 #define XML_HC_LFSR           "lfsr"
+#define XML_HC_BLOCK_LFSR     "block_lfsr"
+#define XML_HC_SHUFFLE        "shuffle"
+#define XML_HC_SHUFFLE_KEY    "shuffle_key"
+
+#define SHUFFLE_LFSR          "lfsr"
+#define SHUFFLE_TWO_LEVEL     "two_level"
+#define SHUFFLE_FEISTEL       "feistel"
 #define XML_HC_CRYPTO         "Crypto"
 #define XML_HC_CRYPTO_SCHEME  "scheme"
 #define XML_HC_CRYPTO_KEY     "key"
 #define XML_HC_CRYPTO_IV      "iv"
+#define XML_HC_CRYPTO_TAG     "tag"
 
 int HcEnginePrivate::keyToXmlFile (const char* key_file_path)
 {
@@ -1281,7 +3890,34 @@ int HcEnginePrivate::keyToXmlFile (const char* key_file_path)
    xml_string = "<" XML_HC_ROOT ">";
    xml_string += "<" XML_HC_VERSION ">";
 
-   sprintf (temp, "%08X", KEY_VERSION);
+   // Only ask for the version the shuffles need, so other keys can still be read by older versions.
+   uint32_t version = KEY_VERSION_1;
+
+   for (auto& ke : m_key)
+   {
+      if ((HC_SHUFFLE_TWO_LEVEL == ke.m_shuffle) && (version < KEY_VERSION_2))
+      {
+         version = KEY_VERSION_2;
+      }
+      else if ((HC_SHUFFLE_FEISTEL == ke.m_shuffle) && (version < KEY_VERSION_3))
+      {
+         version = KEY_VERSION_3;
+      }
+
+      const HcCipherScheme* scheme = find_cipher_scheme (ke.m_cipher);
+
+      if (!scheme)
+      {
+         return HC_ERROR_INVALID_KEY;
+      }
+
+      if (version < scheme->m_version)
+      {
+         version = scheme->m_version;
+      }
+   }
+
+   sprintf (temp, "%08X", version);
 
    xml_string += temp;
    xml_string += "</" XML_HC_VERSION ">";
@@ -1294,10 +3930,49 @@ int HcEnginePrivate::keyToXmlFile (const char* key_file_path)
       xml_string += temp;
       sprintf (temp, "<" XML_HC_OUT_SIZE ">%u</" XML_HC_OUT_SIZE ">", ke.m_out_size);
       xml_string += temp;
-      sprintf (temp, "<" XML_HC_LFSR ">%llu</" XML_HC_LFSR ">", ke.m_lfsr_specs);
-      xml_string += temp;
+
+      switch (ke.m_shuffle)
+      {
+         case HC_SHUFFLE_LFSR:
+            xml_string += "<" XML_HC_SHUFFLE ">" SHUFFLE_LFSR "</" XML_HC_SHUFFLE ">";
+            sprintf (temp, "<" XML_HC_LFSR ">%llu</" XML_HC_LFSR ">", (unsigned long long) ke.m_lfsr_specs);
+            xml_string += temp;
+            break;
+
+         case HC_SHUFFLE_TWO_LEVEL:
+            xml_string += "<" XML_HC_SHUFFLE ">" SHUFFLE_TWO_LEVEL "</" XML_HC_SHUFFLE ">";
+            sprintf (temp, "<" XML_HC_LFSR ">%llu</" XML_HC_LFSR ">", (unsigned long long) ke.m_lfsr_specs);
+            xml_string += temp;
+            sprintf (temp, "<" XML_HC_BLOCK_LFSR ">%llu</" XML_HC_BLOCK_LFSR ">", (unsigned long long) ke.m_block_lfsr_specs);
+            xml_string += temp;
+            break;
+
+         case HC_SHUFFLE_FEISTEL:
+            xml_string += "<" XML_HC_SHUFFLE ">" SHUFFLE_FEISTEL "</" XML_HC_SHUFFLE ">";
+            xml_string += "<" XML_HC_SHUFFLE_KEY ">";
+            hexToString (ke.m_shuffle_key, sizeof (ke.m_shuffle_key), xml_string);
+            xml_string += "</" XML_HC_SHUFFLE_KEY ">";
+            break;
+
+         default:
+            return HC_ERROR_INVALID_KEY;
+      }
+
       xml_string += "<" XML_HC_CRYPTO ">";
-      xml_string += "<" XML_HC_CRYPTO_SCHEME ">" CRYPTO_SCHEME "</" XML_HC_CRYPTO_SCHEME ">";
+
+      const HcCipherScheme* scheme = find_cipher_scheme (ke.m_cipher);
+
+      xml_string += "<" XML_HC_CRYPTO_SCHEME ">";
+      xml_string += scheme->m_name;
+      xml_string += "</" XML_HC_CRYPTO_SCHEME ">";
+
+      if (scheme->m_tag)
+      {
+         xml_string += "<" XML_HC_CRYPTO_TAG ">";
+         hexToString (ke.m_tag, sizeof (ke.m_tag), xml_string);
+         xml_string += "</" XML_HC_CRYPTO_TAG ">";
+      }
+
       xml_string += "<" XML_HC_CRYPTO_IV ">";
       hexToString (ke.m_iv, sizeof (ke.m_iv), xml_string);
       xml_string += "</" XML_HC_CRYPTO_IV ">";
@@ -1348,11 +4023,19 @@ int HcEnginePrivate::xmlFileToKey (const char* key_file_path)
       boost::property_tree::ptree pt;
       boost::property_tree::xml_parser::read_xml (key_file_path, pt);
 
-      std::string version = pt.get<std::string> (XML_HC_ROOT "." XML_HC_VERSION);
+      std::string version_str = pt.get<std::string> (XML_HC_ROOT "." XML_HC_VERSION);
+
+      unsigned long version = std::stoul (version_str, 0, 16);
+
+      if (version > KEY_VERSION)
+      {
+         return HC_ERROR_BAD_KEY;
+      }
 
       auto segments = pt.get_child (XML_HC_ROOT "." XML_HC_SEGMENTS);
 
       HcKeyData kd;
+      memset (&kd, 0, sizeof (kd));
 
       for (auto& s : segments)
       {
@@ -1367,7 +4050,44 @@ int HcEnginePrivate::xmlFileToKey (const char* key_file_path)
 
          kd.m_in_size      = s.second.get<uint32_t> (XML_HC_IN_SIZE);
          kd.m_out_size     = s.second.get<uint32_t> (XML_HC_OUT_SIZE);
-         kd.m_lfsr_specs   = s.second.get<uint64_t> (XML_HC_LFSR);
+         kd.m_lfsr_specs   = 0;
+         kd.m_block_lfsr_specs = 0;
+
+         // Version 1 keys only have the LFSR shuffle.  Version 2 keys written before the shuffle was recorded use the
+         // two-level shuffle when there is a block LFSR.
+         std::string shuffle = SHUFFLE_LFSR;
+
+         if (version >= KEY_VERSION_2)
+         {
+            shuffle = s.second.get<std::string> (XML_HC_SHUFFLE, s.second.count (XML_HC_BLOCK_LFSR) ? SHUFFLE_TWO_LEVEL : SHUFFLE_LFSR);
+         }
+
+         if (!shuffle.compare (SHUFFLE_LFSR))
+         {
+            kd.m_shuffle = HC_SHUFFLE_LFSR;
+            kd.m_lfsr_specs = s.second.get<uint64_t> (XML_HC_LFSR);
+         }
+         else if (!shuffle.compare (SHUFFLE_TWO_LEVEL))
+         {
+            kd.m_shuffle = HC_SHUFFLE_TWO_LEVEL;
+            kd.m_lfsr_specs = s.second.get<uint64_t> (XML_HC_LFSR);
+            kd.m_block_lfsr_specs = s.second.get<uint64_t> (XML_HC_BLOCK_LFSR);
+         }
+         else if (!shuffle.compare (SHUFFLE_FEISTEL) && (version >= KEY_VERSION_3))
+         {
+            kd.m_shuffle = HC_SHUFFLE_FEISTEL;
+
+            if (!stringToHex (&kd.m_shuffle_key, sizeof (kd.m_shuffle_key), s.second.get<std::string> (XML_HC_SHUFFLE_KEY)))
+            {
+               m_key.clear ();
+               return HC_ERROR_BAD_KEY;
+            }
+         }
+         else
+         {
+            m_key.clear ();
+            return HC_ERROR_BAD_KEY;
+         }
 
          auto& c = s.second.get_child (XML_HC_CRYPTO);
 
@@ -1375,6 +4095,23 @@ int HcEnginePrivate::xmlFileToKey (const char* key_file_path)
          crypto_iv_str = c.get<std::string> (XML_HC_CRYPTO_IV);
          crypto_key_str = c.get<std::string> (XML_HC_CRYPTO_KEY);
 
+         // Each segment can have its own scheme.
+         const HcCipherScheme* scheme = find_cipher_scheme (crypto_scheme);
+
+         if (!scheme || (scheme->m_version > version))
+         {
+            m_key.clear ();
+            return HC_ERROR_BAD_KEY;
+         }
+
+         kd.m_cipher = scheme->m_cipher;
+
+         if (scheme->m_tag && !stringToHex (&kd.m_tag, sizeof (kd.m_tag), c.get<std::string> (XML_HC_CRYPTO_TAG)))
+         {
+            m_key.clear ();
+            return HC_ERROR_BAD_KEY;
+         }
+
          if (!stringToHex (&kd.m_iv, sizeof (kd.m_iv), crypto_iv_str))
          {
             throw;
@@ -1457,9 +4194,45 @@ bool HcEnginePrivate::stringToHex (void* buffer, int count, const std::string& s
    return true;
 }
 
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+// OpenSSL before 1.1.0 needs a locking callback before it can be used from several threads.
+static std::mutex* openssl_locks = 0;
+
+static void openssl_locking_callback (int mode, int n, const char*, int)
+{
+   if (mode & CRYPTO_LOCK)
+   {
+      openssl_locks[n].lock ();
+   }
+   else
+   {
+      openssl_locks[n].unlock ();
+   }
+}
+
+static void init_openssl_locks (void)
+{
+   // Leave it alone if the application has already set one up.
+   if (CRYPTO_get_locking_callback ())
+   {
+      return;
+   }
+
+   openssl_locks = new std::mutex[CRYPTO_num_locks ()];
+
+   CRYPTO_set_locking_callback (openssl_locking_callback);
+}
+#endif
+
 //------------------------------------------
 HcEngine* HcEngine::create (void)
 {
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+   static std::once_flag openssl_once;
+
+   std::call_once (openssl_once, init_openssl_locks);
+#endif
+
    return new HcEnginePrivate;
 }
 
@@ -0,0 +1,133 @@
+/*
+   The MIT License(MIT)
+
+   Copyright(c) 2015 Jamal Benbrahim
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files(the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and / or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions :
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+*/
+
+#include "HcFileMap.hpp"
+
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+HcFileMap::HcFileMap (void)
+{
+   m_data = 0;
+   m_size = 0;
+   m_mapping = 0;
+}
+
+// Map size bytes of a file.  To write, the file is first given its size, with the disk space allocated where the
+// system can, so a full disk fails here and not on a write to the map.
+bool HcFileMap::map (FILE* file, uint64_t size, bool write)
+{
+   unmap ();
+
+   if (!file || !size || (size > (uint64_t) SIZE_MAX))
+   {
+      return false;
+   }
+
+#ifdef _WIN32
+   int fd = _fileno (file);
+   HANDLE handle = (HANDLE) _get_osfhandle (fd);
+
+   if (write && _chsize_s (fd, (__int64) size))
+   {
+      return false;
+   }
+
+   m_mapping = CreateFileMapping (handle, 0, write ? PAGE_READWRITE : PAGE_READONLY, (DWORD) (size >> 32), (DWORD) size, 0);
+
+   if (!m_mapping)
+   {
+      return false;
+   }
+
+   m_data = (uint8_t*) MapViewOfFile ((HANDLE) m_mapping, write ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, (SIZE_T) size);
+
+   if (!m_data)
+   {
+      CloseHandle ((HANDLE) m_mapping);
+      m_mapping = 0;
+      return false;
+   }
+#else
+   int fd = fileno (file);
+
+   if (write)
+   {
+#ifdef __linux__
+      if (posix_fallocate (fd, 0, (off_t) size))
+#else
+      if (ftruncate (fd, (off_t) size))
+#endif
+      {
+         return false;
+      }
+   }
+
+   void* data = mmap (0, (size_t) size, write ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, fd, 0);
+
+   if (MAP_FAILED == data)
+   {
+      return false;
+   }
+
+   m_data = (uint8_t*) data;
+#endif
+
+   m_size = (size_t) size;
+
+   return true;
+}
+
+void HcFileMap::unmap (void)
+{
+   if (m_data)
+   {
+#ifdef _WIN32
+      UnmapViewOfFile (m_data);
+      CloseHandle ((HANDLE) m_mapping);
+#else
+      munmap (m_data, m_size);
+#endif
+   }
+
+   m_data = 0;
+   m_size = 0;
+   m_mapping = 0;
+}
+
+uint8_t* HcFileMap::getData (void)
+{
+   return m_data;
+}
+
+size_t HcFileMap::getSize (void)
+{
+   return m_size;
+}
@@ -0,0 +1,53 @@
+/*
+   The MIT License(MIT)
+
+   Copyright(c) 2015 Jamal Benbrahim
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files(the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and / or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions :
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+*/
+
+#ifndef __HCFILEMAP_HPP__
+#define __HCFILEMAP_HPP__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+/*
+   Maps an open file into memory, to read, or to write once it is grown to its size.  Like the FILE it maps, it is
+   let go explicitly, and copying it does not map the file again.
+*/
+class HcFileMap
+{
+   public:
+      HcFileMap (void);
+
+      bool map (FILE* file, uint64_t size, bool write);
+      void unmap (void);
+
+      uint8_t* getData (void);
+      size_t getSize (void);
+
+   private:
+      uint8_t* m_data;
+      size_t m_size;
+      void* m_mapping;
+};
+
+#endif
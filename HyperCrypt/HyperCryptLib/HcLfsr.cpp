@@ -25,22 +25,38 @@
 #include <stdint.h>
 #include <random>
 
-#include <vector>
-
 #include "HcLfsr.hpp"
 
 //#define VERBOSE
 
-#define MIN_BITS 15
+#define MIN_BITS 8
 #define MAX_BITS 28
 #define MAX_POLIES (MAX_BITS - MIN_BITS + 1)
+#define MAX_VARIANTS 32
 
 /*
    derived from:
    Error Correction Coding: Mathematical Methods and Algorithms by Todd K. Moon, Utah State University published by Wiley, 2005 756+xliii pages, plus Web page. (ISBN 0-471-64800-0)
+
+   The 8 to 14 bit polies, used for small segments, are the first primitive polies of each size whose reciprocal is
+   not already in the list.
 */
-static const uint32_t poly_tables[MAX_POLIES][16] =
+static constexpr uint32_t poly_tables[MAX_POLIES][16] =
 {
+	// 8 Bits
+	{0x0000011D, 0x0000012B, 0x0000012D, 0x0000014D, 0x0000015F, 0x00000163, 0x00000187, 0x000001CF, 0x00000000},
+	// 9 Bits
+	{0x00000211, 0x0000021B, 0x0000022D, 0x00000233, 0x00000259, 0x0000025F, 0x0000026F, 0x00000277, 0x00000000},
+	// 10 Bits
+	{0x00000409, 0x0000041B, 0x00000427, 0x0000042D, 0x00000465, 0x0000046F, 0x0000048B, 0x000004C5, 0x00000000},
+	// 11 Bits
+	{0x00000805, 0x00000817, 0x0000082B, 0x0000082D, 0x00000847, 0x00000863, 0x00000865, 0x00000871, 0x00000000},
+	// 12 Bits
+	{0x00001053, 0x00001069, 0x0000107B, 0x0000107D, 0x00001099, 0x000010D1, 0x000010EB, 0x00001107, 0x00000000},
+	// 13 Bits
+	{0x0000201B, 0x00002027, 0x00002035, 0x00002053, 0x00002065, 0x0000206F, 0x0000208B, 0x0000208D, 0x00000000},
+	// 14 Bits
+	{0x0000402B, 0x00004039, 0x00004053, 0x0000405F, 0x0000407B, 0x000040A9, 0x000040AF, 0x000040BB, 0x00000000},
 	// 15 Bits
 	{0x00008423, 0x0000900B, 0x00008437, 0x000088C7, 0x000080CF, 0x0000FFFD, 0x00008729, 0x0000903D, 0x00008431, 0x000099D5, 0x000086A9, 0x00000000},
 	// 16 Bits
@@ -85,9 +101,6 @@ union LfsrSpec
 
 #pragma pack ()
 
-static std::vector<uint32_t> polies [MAX_POLIES];
-static bool initialized = false;
-
 #define NEXT_LFSR(_lfsr, _poly) _lfsr = (_lfsr & 1) ? ((_lfsr >> 1) ^ _poly) : (_lfsr >> 1);
 
 // Return a random number between min and max, inclusive.
@@ -100,145 +113,172 @@ static int get_random (int min, int max)
    return dist (gen);
 }
 
-// Verify that the specified polynomial generates a unique sequence from 1 to (1 << bit_count) - 1
-static bool verify_poly (uint32_t poly, int bit_count, uint32_t seed)
+/*
+   GF(2) polynomial helpers.
+
+   One NEXT_LFSR step with the mask poly multiplies the state by x^-1 modulo Q(x) = (poly << 1) | 1.  The LFSR
+   therefore visits every value from 1 to (1 << bit_count) - 1 exactly when Q(x) is a primitive polynomial of
+   degree bit_count, which can be checked without walking the sequence.
+*/
+
+// Multiply a by b modulo q, where q is a polynomial of degree bit_count.
+static constexpr uint32_t gf2_mulmod (uint32_t a, uint32_t b, uint32_t q, uint32_t bit_count)
 {
-   size_t max_period = (1 << bit_count) - 1;
-   seed &= max_period;
-   uint32_t lfsr = seed;
+   uint32_t r = 0;
+
+   // Branch free, since the bits are random.
+   for (int i = (int) bit_count - 1; i >= 0; --i)
+   {
+      r <<= 1;
+      r ^= q & (0 - ((r >> bit_count) & 1));
+      r ^= a & (0 - ((b >> i) & 1));
+   }
 
-   std::vector<uint32_t> vals;
-   vals.resize (1 << bit_count, 0xFFFFFFFF);
+   return r;
+}
 
-   size_t period = 0;
-   uint32_t* val_buf = &vals[0];
+// Raise a to the power e modulo q, where q is a polynomial of degree bit_count.
+static constexpr uint32_t gf2_powmod (uint32_t a, uint64_t e, uint32_t q, uint32_t bit_count)
+{
+   uint32_t r = 1;
 
-   do
+   while (e)
    {
-      if (lfsr > max_period)
+      if (e & 1)
       {
-         break;
+         r = gf2_mulmod (r, a, q, bit_count);
       }
 
-      val_buf[lfsr] = lfsr;
-
-      NEXT_LFSR (lfsr, poly);
-
-      ++period;
+      a = gf2_mulmod (a, a, q, bit_count);
+      e >>= 1;
+   }
 
-   } while ((lfsr != seed) && (period < max_period));
+   return r;
+}
 
-   // The LFSR should not generate a value of 0.  So, set the 0th slot.
-   vals[0] = 0;
+// Return the number of bits in the poly, which is the degree of the LFSR.
+static uint32_t get_bit_count (uint32_t poly)
+{
+   uint32_t bit_count = 0;
 
-   // Make sure all the slots have been set. 
-   for (size_t i = 0; i < vals.size(); ++i)
+   while ((bit_count < 32) && (poly >> bit_count))
    {
-      if (0xFFFFFFFF == val_buf[i])
-      {
-#ifdef VERBOSE
-         printf ("%d:%s\n", __LINE__, __FUNCTION__);
-#endif
-         return false;
-      }
+      ++bit_count;
    }
 
-   return true;
+   return bit_count;
 }
 
-// Prep the polies for the algorithm and generate derived polies.  Optionally verify that the poly generates unique values.
-static bool create_polies (bool verify, uint32_t max_bits)
+// Verify that the specified poly generates a unique sequence from 1 to (1 << bit_count) - 1.
+static constexpr bool verify_poly (uint32_t poly, uint32_t bit_count)
 {
-   initialized = false;
+   // The poly must be exactly bit_count bits wide.
+   if ((poly >> (bit_count - 1)) != 1)
+   {
+      return false;
+   }
 
-   uint32_t max_polies = max_bits - MIN_BITS + 1;
+   uint32_t q = (poly << 1) | 1;
+   uint32_t period = (1u << bit_count) - 1;
 
-   for (uint32_t i = 0; i < max_polies; ++i)
+   // x^period must be 1...
+   if (gf2_powmod (2, period, q, bit_count) != 1)
    {
-      polies[i].clear ();
+      return false;
    }
 
-   for (uint32_t i = 0; i < max_polies; ++i)
+   // ... and no x^(period / f) may be 1 for any prime factor f of the period.
+   uint32_t n = period;
+
+   for (uint32_t f = 3; n > 1; f += 2)
    {
-      const uint32_t* poly_entry = poly_tables[i];
+      if ((f * f) > n)
+      {
+         f = n;
+      }
 
-#ifdef VERBOSE
-      printf ("Adding polies for: %d bits -- ", i + MIN_BITS);
-#endif
+      if (n % f)
+      {
+         continue;
+      }
 
-      bool reversed = false;
+      if (gf2_powmod (2, period / f, q, bit_count) == 1)
+      {
+         return false;
+      }
 
-	  while (*poly_entry)
+      while (!(n % f))
       {
-         uint32_t p = 0;
+         n /= f;
+      }
+   }
 
-         if (reversed)
-         {
-            for (uint32_t j = 0; j < (MIN_BITS + i); ++j)
-            {
-               p <<= 1;
-			   p |= (*poly_entry & (1 << j)) ? 1 : 0;
-            }
-         }
-         else
-         {
-			 p = (*poly_entry >> 1);
-         }
+   return true;
+}
 
-		 // Verify the poly using a fixed seed.  Any non-zero seed should work fine.
-         if (verify && !verify_poly (p, i + MIN_BITS, 0x12345678))
-         {
-#ifdef VERBOSE
-            printf ("%d:%s - %o - %s\n", __LINE__, __FUNCTION__, *poly_specs, reversed ? "reversed" : "non-reversed");
-#endif
-            return false;
-         }
+// The polies used by the algorithm, indexed by bit count, including the derived (bit-reversed) polies.
+struct PolyTable
+{
+   uint32_t count[MAX_POLIES];
+   uint32_t polies[MAX_POLIES][MAX_VARIANTS];
+};
 
-         polies[i].push_back (p);
+// Prep the polies for the algorithm and generate derived polies.
+static constexpr PolyTable create_polies (void)
+{
+   PolyTable t = {};
 
-#ifdef VERBOSE
-         printf ("%d ", polies[i].size ());
-#endif
+   for (uint32_t i = 0; i < MAX_POLIES; ++i)
+   {
+      uint32_t bit_count = MIN_BITS + i;
 
-         if (reversed)
-         {
-            reversed = false;
-			++poly_entry;
-         }
-         else
+      for (const uint32_t* poly_entry = poly_tables[i]; *poly_entry; ++poly_entry)
+      {
+         // Drop the x^0 term; the LFSR shifts it out.
+         t.polies[i][t.count[i]++] = *poly_entry >> 1;
+
+         // The reciprocal poly is primitive too.
+         uint32_t p = 0;
+
+         for (uint32_t j = 0; j < bit_count; ++j)
          {
-            reversed = true;
+            p <<= 1;
+            p |= (*poly_entry & (1u << j)) ? 1 : 0;
          }
-      }
 
-#ifdef VERBOSE
-      printf ("\n");
-#endif
+         t.polies[i][t.count[i]++] = p;
+      }
    }
 
-   initialized = true;
+   return t;
+}
 
-   if (verify)
+// Verify all the polies once, at build time.
+static constexpr bool verify_polies (const PolyTable& t)
+{
+   for (uint32_t i = 0; i < MAX_POLIES; ++i)
    {
-      uint32_t i;
+      if (!t.count[i] || (t.count[i] > MAX_VARIANTS))
+      {
+         return false;
+      }
 
-      for (i = 0; i < max_polies; ++i)
+      for (uint32_t j = 0; j < t.count[i]; ++j)
       {
-         if (polies[i].empty ())
+         if (!verify_poly (t.polies[i][j], MIN_BITS + i))
          {
-#ifdef VERBOSE
-            printf ("%d:%s\n", __LINE__, __FUNCTION__);
-#endif
             return false;
          }
       }
-
-      initialized = (max_polies == i);
    }
 
-   return initialized;
+   return true;
 }
 
+static constexpr PolyTable polies = create_polies ();
+
+static_assert (verify_polies (polies), "HcLfsr: poly_tables contains a poly that does not generate a full period");
+
 HcLfsr::HcLfsr (uint32_t max_bits)
 {
    if (!max_bits)
@@ -260,16 +300,12 @@ HcLfsr::HcLfsr (uint32_t max_bits)
    m_lfsr = 0;
    m_seed = 0;
    m_poly = 0;
+   m_table_poly = 0;
 }
 
 // Return a 64-bit number that defines the poly and seed used.
 uint64_t HcLfsr::getSpec (void)
 {
-   if (!initialized)
-   {
-      return 0;
-   }
-
    if (!m_seed || !m_poly)
    {
       return 0;
@@ -286,11 +322,6 @@ uint64_t HcLfsr::getSpec (void)
 // Set the poly and seed to be used by the LFSR.
 bool HcLfsr::setSpec (uint64_t spec)
 {
-   if (!initialized)
-   {
-      create_polies (false, m_max_bits);
-   }
-
    LfsrSpec s;
 
    s.spec = spec;
@@ -324,11 +355,6 @@ bool HcLfsr::reset (uint32_t size, uint32_t seed, int variant)
 {
    m_poly = 0;
 
-   if (!initialized)
-   {
-      create_polies (false, m_max_bits);
-   }
-
    if ((size > (1u << m_max_bits)) || (size < getMinSize ()))
    {
       return false;
@@ -353,24 +379,13 @@ bool HcLfsr::reset (uint32_t size, uint32_t seed, int variant)
       return false;
    }
 
-   if (!initialized)
-   {
-      if (!create_polies (false, m_max_bits))
-      {
-#ifdef VERBOSE
-         printf ("%d:%s\n", __LINE__, __FUNCTION__);
-#endif
-         return false;
-      }
-   }
-
    if (variant < 0)
    {
-      variant = (uint8_t) get_random (0, (int) polies[poly_index].size () - 1);
+      variant = (uint8_t) get_random (0, (int) polies.count[poly_index] - 1);
    }
    else
    {
-      variant = (uint8_t) (variant % polies[poly_index].size ());
+      variant = (uint8_t) (variant % polies.count[poly_index]);
    }
 
    while (!seed)
@@ -380,12 +395,13 @@ bool HcLfsr::reset (uint32_t size, uint32_t seed, int variant)
 
    seed &= ((1 << (poly_index + MIN_BITS)) - 1);
 
-   if (!verify_poly (polies[poly_index][variant], poly_index + MIN_BITS, seed))
+   // The polies have been verified at build time; only a zero seed can still stall the sequence.
+   if (!seed)
    {
       return false;
    }
 
-   m_poly = polies[poly_index][variant];
+   m_poly = polies.polies[poly_index][variant];
    m_seed = seed;
    m_lfsr = m_seed;
 
@@ -405,19 +421,118 @@ uint32_t HcLfsr::getNext (void)
    return m_lfsr;
 }
 
-// Fill buffer with the next count sequence numbers.
-bool HcLfsr::fillNext (uint32_t* buffer, uint32_t count)
+// Build the table used by fillNext to generate 8 steps at a time.
+void HcLfsr::buildStepTable (void)
 {
-   while (count--)
+   for (uint32_t b = 0; b < 256; ++b)
    {
-      NEXT_LFSR (m_lfsr, m_poly);
-      *buffer++ = m_lfsr;
+      uint32_t lfsr = b;
 
-      if (!m_lfsr)
+      for (uint32_t i = 0; i < 8; ++i)
       {
-         return false;
+         NEXT_LFSR (lfsr, m_poly);
+         m_step_table[b][i] = lfsr;
       }
    }
 
-   return true;
+   m_table_poly = m_poly;
+}
+
+/*
+   Fill buffer with the next count sequence numbers.
+
+   The step is linear, so the state after i steps (i <= 8) is the high bits shifted right by i, which never feed
+   back within those 8 steps, xor'ed with the state after i steps of the low byte alone.  All 8 outputs depend
+   only on the current state, so they are computed independently instead of as a chain of single steps.
+*/
+bool HcLfsr::fillNext (uint32_t* buffer, uint32_t count)
+{
+   if (!m_poly || !m_seed)
+   {
+      return false;
+   }
+
+   if (m_table_poly != m_poly)
+   {
+      buildStepTable ();
+   }
+
+   uint32_t lfsr = m_lfsr;
+
+   while (count >= 8)
+   {
+      const uint32_t* t = m_step_table[lfsr & 0xFF];
+      uint32_t high = lfsr & ~0xFFu;
+
+      buffer[0] = (high >> 1) ^ t[0];
+      buffer[1] = (high >> 2) ^ t[1];
+      buffer[2] = (high >> 3) ^ t[2];
+      buffer[3] = (high >> 4) ^ t[3];
+      buffer[4] = (high >> 5) ^ t[4];
+      buffer[5] = (high >> 6) ^ t[5];
+      buffer[6] = (high >> 7) ^ t[6];
+      buffer[7] = (high >> 8) ^ t[7];
+
+      lfsr = buffer[7];
+      buffer += 8;
+      count -= 8;
+   }
+
+   while (count--)
+   {
+      NEXT_LFSR (lfsr, m_poly);
+      *buffer++ = lfsr;
+   }
+
+   m_lfsr = lfsr;
+
+   // Once the sequence hits 0 it stays at 0, so checking the last number covers all of them.
+   return (0 != m_lfsr);
+}
+
+// Return the value that moves the sequence count steps ahead when passed to jump.  Each step multiplies by x^-1, which is the poly itself.
+uint32_t HcLfsr::getJump (uint32_t poly, uint64_t count)
+{
+   uint32_t bit_count = get_bit_count (poly);
+
+   if (!bit_count || (bit_count > 31))
+   {
+      return 0;
+   }
+
+   return gf2_powmod (poly, count, (poly << 1) | 1, bit_count);
+}
+
+// Return the state that follows lfsr by the number of steps jump was created for.
+uint32_t HcLfsr::jump (uint32_t lfsr, uint32_t poly, uint32_t jump)
+{
+   uint32_t bit_count = get_bit_count (poly);
+
+   if (!bit_count || (bit_count > 31))
+   {
+      return 0;
+   }
+
+   return gf2_mulmod (lfsr, jump, (poly << 1) | 1, bit_count);
+}
+
+// Advance the sequence by count steps without generating them.
+bool HcLfsr::skip (uint64_t count)
+{
+   if (!m_poly || !m_lfsr)
+   {
+      return false;
+   }
+
+   m_lfsr = jump (m_lfsr, m_poly, getJump (m_poly, count));
+
+   return (0 != m_lfsr);
+}
+
+// Move to the given position in the sequence, where position 0 is the seed.  The next number returned is position + 1.
+bool HcLfsr::seekTo (uint64_t position)
+{
+   m_lfsr = m_seed;
+
+   return skip (position);
 }
@@ -27,6 +27,7 @@
 
 #include <stdint.h>
 
+// The polies are built and verified at compile time and never change, so any number of HcLfsr can be used on different threads.
 class HcLfsr
 {
    public:
@@ -43,11 +44,25 @@ class HcLfsr
       uint32_t getNext (void);
       bool fillNext (uint32_t* buffer, uint32_t count);
 
+      bool skip (uint64_t count);
+      bool seekTo (uint64_t position);
+
+      static uint32_t getJump (uint32_t poly, uint64_t count);
+      static uint32_t jump (uint32_t lfsr, uint32_t poly, uint32_t jump);
+
    private:
+      friend class HcLfsrBank;
+
+      void buildStepTable (void);
+
       uint32_t m_lfsr;
       uint32_t m_seed;
       uint32_t m_poly;
       uint32_t m_max_bits;
+
+      // The intermediate states of 8 steps for every value of the low byte, for the poly in m_table_poly.
+      uint32_t m_table_poly;
+      uint32_t m_step_table[256][8];
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,328 @@
+/*
+   The MIT License(MIT)
+
+   Copyright(c) 2015 Jamal Benbrahim
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files(the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and / or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions :
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+*/
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HC_LFSR_BANK_AVX
+#include <immintrin.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64)
+#define HC_LFSR_BANK_SSE2
+#include <emmintrin.h>
+#endif
+
+#include "HcLfsr.hpp"
+#include "HcLfsrBank.hpp"
+
+/*
+   Every kernel runs the same Galois step as NEXT_LFSR on all the lanes:
+
+      lfsr = (lfsr >> 1) ^ (poly & -(lfsr & 1))
+
+   and stores the states of all the lanes after each step, so buffer[i * LANES + lane] is the (i + 1)th number of
+   that lane.  Inactive lanes have a zero state and a zero poly, and stay at zero.
+*/
+typedef void (*FillFunction)(uint32_t* lfsr, const uint32_t* poly, uint32_t* buffer, uint32_t count);
+
+#ifndef HC_LFSR_BANK_SSE2
+static void fill_scalar (uint32_t* lfsr, const uint32_t* poly, uint32_t* buffer, uint32_t count)
+{
+   uint32_t s[HcLfsrBank::LANES];
+
+   memcpy (s, lfsr, sizeof (s));
+
+   while (count--)
+   {
+      for (uint32_t i = 0; i < HcLfsrBank::LANES; ++i)
+      {
+         s[i] = (s[i] >> 1) ^ (poly[i] & (0 - (s[i] & 1)));
+         buffer[i] = s[i];
+      }
+
+      buffer += HcLfsrBank::LANES;
+   }
+
+   memcpy (lfsr, s, sizeof (s));
+}
+#endif
+
+#ifdef HC_LFSR_BANK_SSE2
+static void fill_sse2 (uint32_t* lfsr, const uint32_t* poly, uint32_t* buffer, uint32_t count)
+{
+   const int VECTORS = HcLfsrBank::LANES / 4;
+
+   __m128i s[VECTORS];
+   __m128i p[VECTORS];
+
+   for (int v = 0; v < VECTORS; ++v)
+   {
+      s[v] = _mm_loadu_si128 ((const __m128i*) &lfsr[v * 4]);
+      p[v] = _mm_loadu_si128 ((const __m128i*) &poly[v * 4]);
+   }
+
+   while (count--)
+   {
+      for (int v = 0; v < VECTORS; ++v)
+      {
+         __m128i mask = _mm_srai_epi32 (_mm_slli_epi32 (s[v], 31), 31);
+         s[v] = _mm_xor_si128 (_mm_srli_epi32 (s[v], 1), _mm_and_si128 (p[v], mask));
+         _mm_storeu_si128 ((__m128i*) &buffer[v * 4], s[v]);
+      }
+
+      buffer += HcLfsrBank::LANES;
+   }
+
+   for (int v = 0; v < VECTORS; ++v)
+   {
+      _mm_storeu_si128 ((__m128i*) &lfsr[v * 4], s[v]);
+   }
+}
+#endif
+
+#ifdef HC_LFSR_BANK_AVX
+__attribute__ ((target ("avx2")))
+static void fill_avx2 (uint32_t* lfsr, const uint32_t* poly, uint32_t* buffer, uint32_t count)
+{
+   const int VECTORS = HcLfsrBank::LANES / 8;
+
+   __m256i s[VECTORS];
+   __m256i p[VECTORS];
+
+   for (int v = 0; v < VECTORS; ++v)
+   {
+      s[v] = _mm256_loadu_si256 ((const __m256i*) &lfsr[v * 8]);
+      p[v] = _mm256_loadu_si256 ((const __m256i*) &poly[v * 8]);
+   }
+
+   while (count--)
+   {
+      for (int v = 0; v < VECTORS; ++v)
+      {
+         __m256i mask = _mm256_srai_epi32 (_mm256_slli_epi32 (s[v], 31), 31);
+         s[v] = _mm256_xor_si256 (_mm256_srli_epi32 (s[v], 1), _mm256_and_si256 (p[v], mask));
+         _mm256_storeu_si256 ((__m256i*) &buffer[v * 8], s[v]);
+      }
+
+      buffer += HcLfsrBank::LANES;
+   }
+
+   for (int v = 0; v < VECTORS; ++v)
+   {
+      _mm256_storeu_si256 ((__m256i*) &lfsr[v * 8], s[v]);
+   }
+}
+
+__attribute__ ((target ("avx512f")))
+static void fill_avx512 (uint32_t* lfsr, const uint32_t* poly, uint32_t* buffer, uint32_t count)
+{
+   const int VECTORS = HcLfsrBank::LANES / 16;
+
+   const __m512i one = _mm512_set1_epi32 (1);
+
+   __m512i s[VECTORS];
+   __m512i p[VECTORS];
+
+   for (int v = 0; v < VECTORS; ++v)
+   {
+      s[v] = _mm512_loadu_si512 (&lfsr[v * 16]);
+      p[v] = _mm512_loadu_si512 (&poly[v * 16]);
+   }
+
+   while (count--)
+   {
+      for (int v = 0; v < VECTORS; ++v)
+      {
+         __mmask16 odd = _mm512_test_epi32_mask (s[v], one);
+         __m512i half = _mm512_maskz_srli_epi32 ((__mmask16) 0xFFFF, s[v], 1);
+         s[v] = _mm512_mask_xor_epi32 (half, odd, half, p[v]);
+         _mm512_storeu_si512 (&buffer[v * 16], s[v]);
+      }
+
+      buffer += HcLfsrBank::LANES;
+   }
+
+   for (int v = 0; v < VECTORS; ++v)
+   {
+      _mm512_storeu_si512 (&lfsr[v * 16], s[v]);
+   }
+}
+#endif
+
+struct FillEngine
+{
+   const char* name;
+   FillFunction fill;
+};
+
+// Pick the widest kernel the CPU supports.
+static FillEngine select_engine (void)
+{
+#ifdef HC_LFSR_BANK_AVX
+   __builtin_cpu_init ();
+
+   if (__builtin_cpu_supports ("avx512f"))
+   {
+      return {"avx512", fill_avx512};
+   }
+
+   if (__builtin_cpu_supports ("avx2"))
+   {
+      return {"avx2", fill_avx2};
+   }
+#endif
+
+#ifdef HC_LFSR_BANK_SSE2
+   return {"sse2", fill_sse2};
+#else
+   return {"scalar", fill_scalar};
+#endif
+}
+
+static const FillEngine& get_engine (void)
+{
+   static const FillEngine engine = select_engine ();
+
+   return engine;
+}
+
+HcLfsrBank::HcLfsrBank (void)
+{
+   clear ();
+}
+
+// Deactivate all the lanes.
+void HcLfsrBank::clear (void)
+{
+   memset (m_lfsr, 0, sizeof (m_lfsr));
+   memset (m_poly, 0, sizeof (m_poly));
+   memset (m_jump, 0, sizeof (m_jump));
+   m_active = 0;
+   m_jump_count = 0;
+}
+
+// Make the lane generate the sequence of lfsr, starting after the given position.
+bool HcLfsrBank::setLane (uint32_t lane, const HcLfsr& lfsr, uint64_t position)
+{
+   if ((lane >= LANES) || !lfsr.m_poly || !lfsr.m_seed)
+   {
+      return false;
+   }
+
+   m_poly[lane] = lfsr.m_poly;
+   m_lfsr[lane] = HcLfsr::jump (lfsr.m_seed, lfsr.m_poly, HcLfsr::getJump (lfsr.m_poly, position));
+   m_jump[lane] = 0;
+   m_active |= (1u << lane);
+
+   return (0 != m_lfsr[lane]);
+}
+
+// Split the sequence of lfsr over the first lanes: lane i starts after position + i * stride.
+bool HcLfsrBank::setLanes (const HcLfsr& lfsr, uint64_t position, uint64_t stride, uint32_t lanes)
+{
+   if (!lanes || (lanes > LANES) || !setLane (0, lfsr, position))
+   {
+      return false;
+   }
+
+   uint32_t jump = HcLfsr::getJump (lfsr.m_poly, stride);
+
+   for (uint32_t i = 1; i < lanes; ++i)
+   {
+      m_poly[i] = lfsr.m_poly;
+      m_lfsr[i] = HcLfsr::jump (m_lfsr[i - 1], lfsr.m_poly, jump);
+      m_jump[i] = 0;
+      m_active |= (1u << i);
+
+      if (!m_lfsr[i])
+      {
+         return false;
+      }
+   }
+
+   return true;
+}
+
+// Advance all the active lanes by count steps.
+bool HcLfsrBank::skip (uint64_t count)
+{
+   if (count != m_jump_count)
+   {
+      memset (m_jump, 0, sizeof (m_jump));
+      m_jump_count = count;
+   }
+
+   for (uint32_t i = 0; i < LANES; ++i)
+   {
+      if (!(m_active & (1u << i)))
+      {
+         continue;
+      }
+
+      if (!m_jump[i])
+      {
+         // Lanes usually share the poly of one segment.
+         m_jump[i] = (i && (m_poly[i] == m_poly[i - 1]) && m_jump[i - 1]) ? m_jump[i - 1] : HcLfsr::getJump (m_poly[i], count);
+      }
+
+      m_lfsr[i] = HcLfsr::jump (m_lfsr[i], m_poly[i], m_jump[i]);
+
+      if (!m_lfsr[i])
+      {
+         return false;
+      }
+   }
+
+   return true;
+}
+
+// Fill buffer with the next count numbers of every lane: buffer[i * LANES + lane].
+bool HcLfsrBank::fillNext (uint32_t* buffer, uint32_t count)
+{
+   if (!buffer || !m_active)
+   {
+      return false;
+   }
+
+   get_engine ().fill (m_lfsr, m_poly, buffer, count);
+
+   // Once a sequence hits 0 it stays at 0, so checking the last numbers covers all of them.
+   for (uint32_t i = 0; i < LANES; ++i)
+   {
+      if ((m_active & (1u << i)) && !m_lfsr[i])
+      {
+         return false;
+      }
+   }
+
+   return true;
+}
+
+// Return the name of the kernel in use.
+const char* HcLfsrBank::getEngineName (void)
+{
+   return get_engine ().name;
+}
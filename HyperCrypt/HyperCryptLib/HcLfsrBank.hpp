@@ -0,0 +1,60 @@
+/*
+   The MIT License(MIT)
+
+   Copyright(c) 2015 Jamal Benbrahim
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files(the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and / or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions :
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+*/
+
+#ifndef __HCLFSRBANK_HPP__
+#define __HCLFSRBANK_HPP__
+
+#include <stdint.h>
+
+class HcLfsr;
+
+// Steps a bank of independent LFSRs in lock step, using the widest vector unit the CPU has.
+class HcLfsrBank
+{
+   public:
+      enum { LANES = 32 };
+
+      HcLfsrBank (void);
+
+      void clear (void);
+
+      bool setLane (uint32_t lane, const HcLfsr& lfsr, uint64_t position);
+      bool setLanes (const HcLfsr& lfsr, uint64_t position, uint64_t stride, uint32_t lanes);
+
+      bool skip (uint64_t count);
+      bool fillNext (uint32_t* buffer, uint32_t count);
+
+      static const char* getEngineName (void);
+
+   private:
+      uint32_t m_lfsr[LANES];
+      uint32_t m_poly[LANES];
+      uint32_t m_active;
+
+      // The jumps used by the last skip, which only depend on the poly and the count.
+      uint32_t m_jump[LANES];
+      uint64_t m_jump_count;
+};
+
+#endif
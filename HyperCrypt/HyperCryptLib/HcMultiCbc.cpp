@@ -0,0 +1,213 @@
+/*
+   The MIT License(MIT)
+
+   Copyright(c) 2015 Jamal Benbrahim
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files(the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and / or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions :
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+*/
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HC_MULTI_CBC_AESNI
+#include <immintrin.h>
+#endif
+
+#include "HcMultiCbc.hpp"
+
+#ifdef HC_MULTI_CBC_AESNI
+/*
+   AES-256 key expansion.  Every even round key comes from the two before it through the S-box and the round
+   constant, and every odd one through the S-box only.
+*/
+__attribute__ ((target ("aes,sse2")))
+static inline __m128i expand_even (__m128i key, __m128i assist)
+{
+   key = _mm_xor_si128 (key, _mm_slli_si128 (key, 4));
+   key = _mm_xor_si128 (key, _mm_slli_si128 (key, 4));
+   key = _mm_xor_si128 (key, _mm_slli_si128 (key, 4));
+
+   return _mm_xor_si128 (key, _mm_shuffle_epi32 (assist, 0xFF));
+}
+
+__attribute__ ((target ("aes,sse2")))
+static inline __m128i expand_odd (__m128i key, __m128i even)
+{
+   __m128i assist = _mm_shuffle_epi32 (_mm_aeskeygenassist_si128 (even, 0), 0xAA);
+
+   key = _mm_xor_si128 (key, _mm_slli_si128 (key, 4));
+   key = _mm_xor_si128 (key, _mm_slli_si128 (key, 4));
+   key = _mm_xor_si128 (key, _mm_slli_si128 (key, 4));
+
+   return _mm_xor_si128 (key, assist);
+}
+
+__attribute__ ((target ("aes,sse2")))
+static void expand_key (const uint8_t* key, uint8_t* round_keys)
+{
+   __m128i rk[15];
+
+   rk[0] = _mm_loadu_si128 ((const __m128i*) key);
+   rk[1] = _mm_loadu_si128 ((const __m128i*) (key + 16));
+
+   rk[2] = expand_even (rk[0], _mm_aeskeygenassist_si128 (rk[1], 0x01));
+   rk[3] = expand_odd (rk[1], rk[2]);
+   rk[4] = expand_even (rk[2], _mm_aeskeygenassist_si128 (rk[3], 0x02));
+   rk[5] = expand_odd (rk[3], rk[4]);
+   rk[6] = expand_even (rk[4], _mm_aeskeygenassist_si128 (rk[5], 0x04));
+   rk[7] = expand_odd (rk[5], rk[6]);
+   rk[8] = expand_even (rk[6], _mm_aeskeygenassist_si128 (rk[7], 0x08));
+   rk[9] = expand_odd (rk[7], rk[8]);
+   rk[10] = expand_even (rk[8], _mm_aeskeygenassist_si128 (rk[9], 0x10));
+   rk[11] = expand_odd (rk[9], rk[10]);
+   rk[12] = expand_even (rk[10], _mm_aeskeygenassist_si128 (rk[11], 0x20));
+   rk[13] = expand_odd (rk[11], rk[12]);
+   rk[14] = expand_even (rk[12], _mm_aeskeygenassist_si128 (rk[13], 0x40));
+
+   for (int r = 0; r < 15; ++r)
+   {
+      _mm_storeu_si128 ((__m128i*) &round_keys[r * 16], rk[r]);
+   }
+}
+
+/*
+   CBC encrypt the same number of blocks on N lanes in place.  The rounds of all the lanes are interleaved, so N
+   blocks are in flight in the AES unit instead of one.
+*/
+template <uint32_t N>
+__attribute__ ((target ("aes,sse2")))
+static void encrypt_lanes (const uint8_t (*round_keys)[15 * 16], uint8_t (*iv)[16], uint8_t* const* data, size_t blocks)
+{
+   __m128i s[N];
+
+   for (uint32_t l = 0; l < N; ++l)
+   {
+      s[l] = _mm_loadu_si128 ((const __m128i*) iv[l]);
+   }
+
+   for (size_t b = 0; b < blocks; ++b)
+   {
+      for (uint32_t l = 0; l < N; ++l)
+      {
+         __m128i in = _mm_loadu_si128 ((const __m128i*) &data[l][b * 16]);
+
+         s[l] = _mm_xor_si128 (s[l], _mm_xor_si128 (in, _mm_loadu_si128 ((const __m128i*) round_keys[l])));
+      }
+
+#pragma GCC unroll 13
+      for (int r = 1; r < 14; ++r)
+      {
+#pragma GCC unroll 8
+         for (uint32_t l = 0; l < N; ++l)
+         {
+            s[l] = _mm_aesenc_si128 (s[l], _mm_loadu_si128 ((const __m128i*) &round_keys[l][r * 16]));
+         }
+      }
+
+      for (uint32_t l = 0; l < N; ++l)
+      {
+         s[l] = _mm_aesenclast_si128 (s[l], _mm_loadu_si128 ((const __m128i*) &round_keys[l][14 * 16]));
+         _mm_storeu_si128 ((__m128i*) &data[l][b * 16], s[l]);
+      }
+   }
+
+   for (uint32_t l = 0; l < N; ++l)
+   {
+      _mm_storeu_si128 ((__m128i*) iv[l], s[l]);
+   }
+}
+
+typedef void (*EncryptFunction)(const uint8_t (*round_keys)[15 * 16], uint8_t (*iv)[16], uint8_t* const* data, size_t blocks);
+
+static const EncryptFunction s_encrypt_lanes[HcMultiCbc::LANES] =
+{
+   encrypt_lanes<1>, encrypt_lanes<2>, encrypt_lanes<3>, encrypt_lanes<4>,
+   encrypt_lanes<5>, encrypt_lanes<6>, encrypt_lanes<7>, encrypt_lanes<8>
+};
+#endif
+
+HcMultiCbc::HcMultiCbc (void)
+{
+   memset (m_round_keys, 0, sizeof (m_round_keys));
+   memset (m_iv, 0, sizeof (m_iv));
+}
+
+HcMultiCbc::~HcMultiCbc (void)
+{
+   // Do not leave the keys behind.
+   volatile uint8_t* p = &m_round_keys[0][0];
+
+   for (size_t i = 0; i < sizeof (m_round_keys); ++i)
+   {
+      p[i] = 0;
+   }
+}
+
+// Set the 256-bit key and the IV of a lane.
+bool HcMultiCbc::setLane (uint32_t lane, const uint8_t* key, const uint8_t* iv)
+{
+#ifdef HC_MULTI_CBC_AESNI
+   if ((lane >= LANES) || !isSupported ())
+   {
+      return false;
+   }
+
+   expand_key (key, m_round_keys[lane]);
+   memcpy (m_iv[lane], iv, BLOCK_SIZE);
+
+   return true;
+#else
+   return false;
+#endif
+}
+
+// Encrypt blocks 16-byte blocks in place on each of the first lanes lanes, carrying on from the previous call.
+bool HcMultiCbc::encrypt (uint32_t lanes, uint8_t* const* data, size_t blocks)
+{
+#ifdef HC_MULTI_CBC_AESNI
+   if (!lanes || (lanes > LANES) || !isSupported ())
+   {
+      return false;
+   }
+
+   s_encrypt_lanes[lanes - 1] (m_round_keys, m_iv, data, blocks);
+
+   return true;
+#else
+   return false;
+#endif
+}
+
+// Whether the CPU can run the multi-buffer engine.
+bool HcMultiCbc::isSupported (void)
+{
+#ifdef HC_MULTI_CBC_AESNI
+   static const bool supported = (__builtin_cpu_init (), __builtin_cpu_supports ("aes"));
+
+   return supported;
+#else
+   return false;
+#endif
+}
+
+const char* HcMultiCbc::getEngineName (void)
+{
+   return isSupported () ? "aesni" : "none";
+}
@@ -0,0 +1,55 @@
+/*
+   The MIT License(MIT)
+
+   Copyright(c) 2015 Jamal Benbrahim
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files(the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and / or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions :
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+*/
+
+#ifndef __HCMULTICBC_HPP__
+#define __HCMULTICBC_HPP__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+   Encrypts several independent AES-256-CBC streams at once.  A CBC stream is serial, so a single stream leaves most
+   of the AES unit idle.  Interleaving the blocks of up to LANES streams keeps it busy.  Only available with AES-NI.
+*/
+class HcMultiCbc
+{
+   public:
+      enum { LANES = 8, KEY_SIZE = 32, BLOCK_SIZE = 16 };
+
+      HcMultiCbc (void);
+      ~HcMultiCbc (void);
+
+      bool setLane (uint32_t lane, const uint8_t* key, const uint8_t* iv);
+      bool encrypt (uint32_t lanes, uint8_t* const* data, size_t blocks);
+
+      static bool isSupported (void);
+      static const char* getEngineName (void);
+
+   private:
+      // The 15 round keys and the current IV of every lane.
+      uint8_t m_round_keys[LANES][15 * BLOCK_SIZE];
+      uint8_t m_iv[LANES][BLOCK_SIZE];
+};
+
+#endif
@@ -0,0 +1,316 @@
+/*
+   The MIT License(MIT)
+
+   Copyright(c) 2015 Jamal Benbrahim
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files(the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and / or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions :
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+*/
+
+#include <stdint.h>
+#include <string.h>
+
+#include "HcShuffler.hpp"
+
+//------------------------------------------
+HcLfsrShuffler::HcLfsrShuffler (void) : m_lfsr (0)
+{
+   m_chunks_left = 0;
+   m_chunk_index = 0;
+}
+
+bool HcLfsrShuffler::setSpec (uint64_t lfsr_specs)
+{
+   return m_lfsr.setSpec (lfsr_specs);
+}
+
+// Start handing out the chunks of a segment of size bytes, from first_chunk on.
+bool HcLfsrShuffler::start (uint32_t size, uint32_t first_chunk)
+{
+   uint32_t chunk_count = (size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+
+   if (first_chunk >= chunk_count)
+   {
+      return false;
+   }
+
+   m_chunks_left = chunk_count - first_chunk;
+   m_chunk_index = 0;
+
+   uint32_t lanes = (m_chunks_left + RUN_CHUNKS - 1) / RUN_CHUNKS;
+
+   if (lanes > HcLfsrBank::LANES)
+   {
+      lanes = HcLfsrBank::LANES;
+   }
+
+   m_indices.resize (GROUP_SIZE);
+   m_bank.clear ();
+
+   return m_bank.setLanes (m_lfsr, (uint64_t) first_chunk * CHUNK_SIZE, RUN_SIZE, lanes);
+}
+
+bool HcLfsrShuffler::next (uint8_t* segment, HcChunkMap& map)
+{
+   if (!m_chunks_left)
+   {
+      return false;
+   }
+
+   uint32_t group_chunk = m_chunk_index % (RUN_CHUNKS * HcLfsrBank::LANES);
+
+   if (!group_chunk)
+   {
+      if (m_chunk_index && !m_bank.skip (GROUP_SIZE - RUN_SIZE))
+      {
+         return false;
+      }
+
+      // Only the first lane is used when less than a run is left.
+      uint32_t count = (m_chunks_left < RUN_CHUNKS) ? m_chunks_left * CHUNK_SIZE : RUN_SIZE;
+
+      if (!m_bank.fillNext (&m_indices[0], count))
+      {
+         return false;
+      }
+   }
+
+   --m_chunks_left;
+   ++m_chunk_index;
+
+   map.m_base = segment;
+   map.m_indices = &m_indices[(group_chunk % RUN_CHUNKS) * CHUNK_SIZE * HcLfsrBank::LANES + group_chunk / RUN_CHUNKS];
+   map.m_stride = HcLfsrBank::LANES;
+   map.m_last = !m_chunks_left;
+
+   return true;
+}
+
+//------------------------------------------
+HcTwoLevelShuffler::HcTwoLevelShuffler (void) : m_block_lfsr (0)
+{
+   m_chunk_count = 0;
+   m_chunk_index = 0;
+   m_block = 0;
+   m_block_count = 0;
+}
+
+bool HcTwoLevelShuffler::setSpec (uint64_t block_specs, uint64_t byte_specs, uint32_t out_size)
+{
+   HcLfsr byte_lfsr (0);
+
+   m_block_count = out_size / TWO_LEVEL_BLOCK_SIZE;
+
+   if ((out_size < TWO_LEVEL_MIN_SIZE) || !m_block_lfsr.setSpec (block_specs) || !byte_lfsr.setSpec (byte_specs))
+   {
+      return false;
+   }
+
+   // Keep two periods of the byte sequence, so the sequence of every window is a contiguous slice.
+   m_offsets.resize (2 * PERIOD);
+
+   if (!byte_lfsr.fillNext (&m_offsets[0], PERIOD))
+   {
+      return false;
+   }
+
+   for (uint32_t i = 0; i < PERIOD; ++i)
+   {
+      if (m_offsets[i] >= TWO_LEVEL_BLOCK_SIZE)
+      {
+         return false;
+      }
+
+      m_offsets[PERIOD + i] = m_offsets[i];
+   }
+
+   return true;
+}
+
+// Start handing out the chunks of a segment of size bytes, from first_chunk on.
+bool HcTwoLevelShuffler::start (uint32_t size, uint32_t first_chunk)
+{
+   m_chunk_count = (size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+   m_chunk_index = first_chunk;
+
+   if ((first_chunk >= m_chunk_count) || m_offsets.empty ())
+   {
+      return false;
+   }
+
+   uint32_t window = first_chunk / WINDOW_CHUNKS;
+
+   // Window w takes the block at position w + 1 of the block LFSR.
+   if (!m_block_lfsr.seekTo (window))
+   {
+      return false;
+   }
+
+   // If starting in the middle of a window, its block is not picked by next.
+   return (first_chunk % WINDOW_CHUNKS) ? nextBlock (window) : true;
+}
+
+// Pick the block of the window.  The last window goes to block 0, since block 0 is never generated by the LFSR.
+bool HcTwoLevelShuffler::nextBlock (uint32_t window)
+{
+   m_block = (window != (m_chunk_count - 1) / WINDOW_CHUNKS) ? m_block_lfsr.getNext () : 0;
+
+   return (m_block < m_block_count);
+}
+
+bool HcTwoLevelShuffler::next (uint8_t* segment, HcChunkMap& map)
+{
+   if (m_chunk_index >= m_chunk_count)
+   {
+      return false;
+   }
+
+   uint32_t window = m_chunk_index / WINDOW_CHUNKS;
+   uint32_t window_chunk = m_chunk_index % WINDOW_CHUNKS;
+
+   if (!window_chunk && !nextBlock (window))
+   {
+      return false;
+   }
+
+   ++m_chunk_index;
+
+   map.m_base = segment + (size_t) m_block * TWO_LEVEL_BLOCK_SIZE;
+   map.m_indices = &m_offsets[(window % PERIOD) + window_chunk * CHUNK_SIZE];
+   map.m_stride = 1;
+   map.m_last = (m_chunk_index == m_chunk_count) || (WINDOW_CHUNKS - 1 == window_chunk);
+
+   return true;
+}
+
+//------------------------------------------
+HcFeistelShuffler::HcFeistelShuffler (void)
+{
+   memset (m_round_keys, 0, sizeof (m_round_keys));
+   m_high_mask = 0;
+   m_low_mask = 0;
+   m_low_bits = 0;
+   m_chunks_left = 0;
+   m_chunk_index = 0;
+}
+
+// splitmix64 finalizer, used to spread the key over the rounds.
+static inline uint64_t mix64 (uint64_t z)
+{
+   z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+   z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+
+   return z ^ (z >> 31);
+}
+
+// murmur3 finalizer, used as the round function.  It is 32-bit so the rounds of a chunk can be vectorized.
+static inline uint32_t mix32 (uint32_t h)
+{
+   h = (h ^ (h >> 16)) * 0x85EBCA6Bu;
+   h = (h ^ (h >> 13)) * 0xC2B2AE35u;
+
+   return h ^ (h >> 16);
+}
+
+// Set the key and the size of the permutation, which must be a power of 2 LFSR size.
+bool HcFeistelShuffler::setKey (const uint8_t* key, uint32_t out_size)
+{
+   if (!key || (out_size < HcLfsr::getMinSize ()) || (out_size > HcLfsr::getMaxSize ()) || (out_size & (out_size - 1)))
+   {
+      return false;
+   }
+
+   uint32_t bits = 0;
+
+   while ((1u << bits) < out_size)
+   {
+      ++bits;
+   }
+
+   m_low_bits = bits / 2;
+   m_low_mask = (1u << m_low_bits) - 1;
+   m_high_mask = (1u << (bits - m_low_bits)) - 1;
+
+   uint64_t k[2];
+
+   memcpy (k, key, sizeof (k));
+
+   for (int r = 0; r < FEISTEL_ROUNDS; ++r)
+   {
+      k[0] += 0x9E3779B97F4A7C15ULL;
+      m_round_keys[r] = (uint32_t) mix64 (k[0] ^ k[1]);
+   }
+
+   return true;
+}
+
+// Where byte position of the segment goes.
+uint32_t HcFeistelShuffler::perm (uint32_t position) const
+{
+   uint32_t high = position >> m_low_bits;
+   uint32_t low = position & m_low_mask;
+
+   for (int r = 0; r < FEISTEL_ROUNDS; r += 2)
+   {
+      high ^= mix32 (m_round_keys[r] ^ low) & m_high_mask;
+      low ^= mix32 (m_round_keys[r + 1] ^ high) & m_low_mask;
+   }
+
+   return (high << m_low_bits) | low;
+}
+
+// Start handing out the chunks of a segment of size bytes, from first_chunk on.
+bool HcFeistelShuffler::start (uint32_t size, uint32_t first_chunk)
+{
+   uint32_t chunk_count = (size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+
+   if ((first_chunk >= chunk_count) || !m_low_bits)
+   {
+      return false;
+   }
+
+   m_chunks_left = chunk_count - first_chunk;
+   m_chunk_index = first_chunk;
+
+   return true;
+}
+
+bool HcFeistelShuffler::next (uint8_t* segment, HcChunkMap& map)
+{
+   if (!m_chunks_left)
+   {
+      return false;
+   }
+
+   uint32_t position = m_chunk_index * CHUNK_SIZE;
+
+   for (uint32_t i = 0; i < CHUNK_SIZE; ++i)
+   {
+      m_indices[i] = perm (position + i);
+   }
+
+   --m_chunks_left;
+   ++m_chunk_index;
+
+   map.m_base = segment;
+   map.m_indices = m_indices;
+   map.m_stride = 1;
+   map.m_last = false;
+
+   return true;
+}
@@ -0,0 +1,163 @@
+/*
+   The MIT License(MIT)
+
+   Copyright(c) 2015 Jamal Benbrahim
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files(the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and / or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions :
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+*/
+
+#ifndef __HCSHUFFLER_HPP__
+#define __HCSHUFFLER_HPP__
+
+#include <stdint.h>
+#include <vector>
+
+#include "HcLfsr.hpp"
+#include "HcLfsrBank.hpp"
+
+// The segments are encrypted and shuffled this many bytes at a time.
+#define CHUNK_SIZE 256
+
+// Where the bytes of one chunk go in the segment: byte i goes to m_base[m_indices[i * m_stride]], except that the last
+// byte goes to m_base[0] when m_last is set, since index 0 is never generated by the LFSR.
+struct HcChunkMap
+{
+   uint8_t* m_base;
+   const uint32_t* m_indices;
+   uint32_t m_stride;
+   bool m_last;
+};
+
+/*
+   Hands out where the chunks of a segment go in the shuffled segment, one chunk at a time.
+
+   A shuffler is set up with the key of a segment by its own setter, then start picks the first chunk, so a segment
+   can be shuffled from any chunk on, e.g. to split it over several threads.
+*/
+class HcShuffler
+{
+   public:
+      virtual ~HcShuffler (void) {}
+
+      virtual bool start (uint32_t size, uint32_t first_chunk) = 0;
+      virtual bool next (uint8_t* segment, HcChunkMap& map) = 0;
+};
+
+/*
+   One LFSR over the whole segment (KEY_VERSION_1).
+
+   The indices are generated a group of chunks at a time by an HcLfsrBank: every lane covers a run of RUN_CHUNKS
+   consecutive chunks, and jumps over the runs of the other lanes once its run has been used.  The indices of a
+   chunk are interleaved with the other lanes, so the map stride is HcLfsrBank::LANES.
+*/
+class HcLfsrShuffler : public HcShuffler
+{
+   public:
+      enum { RUN_CHUNKS = 8, RUN_SIZE = RUN_CHUNKS * CHUNK_SIZE, GROUP_SIZE = RUN_SIZE * HcLfsrBank::LANES };
+
+      HcLfsrShuffler (void);
+
+      bool setSpec (uint64_t lfsr_specs);
+
+      virtual bool start (uint32_t size, uint32_t first_chunk);
+      virtual bool next (uint8_t* segment, HcChunkMap& map);
+
+   private:
+      HcLfsr m_lfsr;
+      HcLfsrBank m_bank;
+      std::vector<uint32_t> m_indices;
+      uint32_t m_chunks_left;
+      uint32_t m_chunk_index;
+};
+
+#define TWO_LEVEL_BLOCK_SIZE 4096
+#define TWO_LEVEL_MIN_SIZE   (TWO_LEVEL_BLOCK_SIZE * 256)
+
+/*
+   The two-level shuffle (KEY_VERSION_2).
+
+   The segment is taken in windows of TWO_LEVEL_BLOCK_SIZE bytes.  The block LFSR picks the output block of every
+   window, and the byte LFSR shuffles the bytes of the window within that block, starting its sequence one step
+   further for every window.  As in the single-level shuffle, the last window goes to block 0 and the last byte of
+   every window goes to byte 0.  A window is scattered into one block, so the writes stay within one page and the
+   accesses are close to sequential at the cache line level, while the bytes of every AES block are still spread.
+
+   This is weaker than the single-level shuffle.  There is only one 12-bit byte sequence per segment, and every window
+   reads it from a different step, so the byte permutations of the windows are all rotations of one permutation.  Any
+   other seed or start of a 12-bit LFSR is another rotation of the same sequence.  Once one window is known, the bytes
+   of all the others are known up to their rotation.
+
+   The block LFSR needs at least 256 blocks, so smaller segments use the single-level shuffle.
+*/
+class HcTwoLevelShuffler : public HcShuffler
+{
+   public:
+      enum { WINDOW_CHUNKS = TWO_LEVEL_BLOCK_SIZE / CHUNK_SIZE, PERIOD = TWO_LEVEL_BLOCK_SIZE - 1 };
+
+      HcTwoLevelShuffler (void);
+
+      bool setSpec (uint64_t block_specs, uint64_t byte_specs, uint32_t out_size);
+
+      virtual bool start (uint32_t size, uint32_t first_chunk);
+      virtual bool next (uint8_t* segment, HcChunkMap& map);
+
+   private:
+      bool nextBlock (uint32_t window);
+
+      HcLfsr m_block_lfsr;
+      std::vector<uint32_t> m_offsets;
+      uint32_t m_chunk_count;
+      uint32_t m_chunk_index;
+      uint32_t m_block;
+      uint32_t m_block_count;
+};
+
+#define FEISTEL_KEY_SIZE 16
+#define FEISTEL_ROUNDS   8
+
+/*
+   A keyed Feistel permutation of the whole segment (KEY_VERSION_3).
+
+   Byte p of the segment goes to perm (p), where perm splits p into a high and a low half and mixes each half into the
+   other with a keyed hash, a round at a time.  Every round can be undone, so perm is a permutation of the segment, and
+   it is computed directly for any p, with no state carried from one chunk to the next.
+*/
+class HcFeistelShuffler : public HcShuffler
+{
+   public:
+      HcFeistelShuffler (void);
+
+      bool setKey (const uint8_t* key, uint32_t out_size);
+
+      uint32_t perm (uint32_t position) const;
+
+      virtual bool start (uint32_t size, uint32_t first_chunk);
+      virtual bool next (uint8_t* segment, HcChunkMap& map);
+
+   private:
+      uint32_t m_round_keys[FEISTEL_ROUNDS];
+      uint32_t m_high_mask;
+      uint32_t m_low_mask;
+      uint32_t m_low_bits;
+      uint32_t m_chunks_left;
+      uint32_t m_chunk_index;
+      uint32_t m_indices[CHUNK_SIZE];
+};
+
+#endif
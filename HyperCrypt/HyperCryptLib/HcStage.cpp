@@ -0,0 +1,158 @@
+/*
+   The MIT License(MIT)
+
+   Copyright(c) 2015 Jamal Benbrahim
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files(the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and / or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions :
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+*/
+
+#include "HcStage.hpp"
+
+HcStage::HcStage (void)
+{
+   m_submitted = 0;
+   m_completed = 0;
+   m_status = 0;
+   m_stop = false;
+}
+
+HcStage::~HcStage (void)
+{
+   stop ();
+}
+
+// Start the thread of the stage, with no jobs done yet.
+bool HcStage::start (void)
+{
+   stop ();
+
+   try
+   {
+      m_thread = std::thread (&HcStage::worker, this);
+   }
+   catch (...)
+   {
+      return false;
+   }
+
+   return true;
+}
+
+// Drop the jobs that have not started, wait for the running one, and join the thread.
+void HcStage::stop (void)
+{
+   {
+      std::lock_guard<std::mutex> lock (m_mutex);
+
+      m_stop = true;
+      m_jobs.clear ();
+   }
+
+   m_work.notify_all ();
+
+   if (m_thread.joinable ())
+   {
+      m_thread.join ();
+   }
+
+   m_submitted = 0;
+   m_completed = 0;
+   m_status = 0;
+   m_stop = false;
+}
+
+// Queue a job, and return its ticket.
+uint64_t HcStage::submit (const Job& job)
+{
+   if (!m_thread.joinable ())
+   {
+      if (!m_status)
+      {
+         m_status = job ();
+      }
+
+      m_completed = ++m_submitted;
+
+      return m_submitted;
+   }
+
+   {
+      std::lock_guard<std::mutex> lock (m_mutex);
+
+      m_jobs.push_back (job);
+      ++m_submitted;
+   }
+
+   m_work.notify_one ();
+
+   return m_submitted;
+}
+
+// Wait for the job of a ticket, and the ones before it, to be done.  Return the status of the first failed job, or 0.
+// Ticket 0 is no job.
+int HcStage::wait (uint64_t ticket)
+{
+   std::unique_lock<std::mutex> lock (m_mutex);
+
+   m_done.wait (lock, [this, ticket] { return m_completed >= ticket; });
+
+   return m_status;
+}
+
+int HcStage::waitAll (void)
+{
+   return wait (m_submitted);
+}
+
+void HcStage::worker (void)
+{
+   std::unique_lock<std::mutex> lock (m_mutex);
+
+   for (;;)
+   {
+      m_work.wait (lock, [this] { return m_stop || !m_jobs.empty (); });
+
+      if (m_stop)
+      {
+         // The dropped jobs count as done, so nobody waits on them.
+         m_completed = m_submitted;
+         m_done.notify_all ();
+         return;
+      }
+
+      Job job;
+
+      job.swap (m_jobs.front ());
+      m_jobs.pop_front ();
+
+      if (!m_status)
+      {
+         lock.unlock ();
+
+         int status = job ();
+
+         lock.lock ();
+
+         m_status = status;
+      }
+
+      ++m_completed;
+      m_done.notify_all ();
+   }
+}
@@ -0,0 +1,71 @@
+/*
+   The MIT License(MIT)
+
+   Copyright(c) 2015 Jamal Benbrahim
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files(the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and / or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions :
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+*/
+
+#ifndef __HCSTAGE_HPP__
+#define __HCSTAGE_HPP__
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <stdint.h>
+#include <thread>
+
+/*
+   A stage of a pipeline: a thread that runs the jobs given to it one after the other, in order, so reading or writing
+   overlaps the work of the caller.  Every job gets a ticket, and the caller waits on the ticket before reusing the
+   buffer of the job.  Once a job fails, the jobs after it are skipped and every wait returns its status.  Without a
+   thread, the jobs run as they are submitted.
+*/
+class HcStage
+{
+   public:
+      typedef std::function<int (void)> Job;
+
+      HcStage (void);
+      ~HcStage (void);
+
+      bool start (void);
+      void stop (void);
+
+      uint64_t submit (const Job& job);
+      int wait (uint64_t ticket);
+      int waitAll (void);
+
+   private:
+      void worker (void);
+
+      std::thread m_thread;
+      std::mutex m_mutex;
+      std::condition_variable m_work;
+      std::condition_variable m_done;
+
+      std::deque<Job> m_jobs;
+      uint64_t m_submitted;
+      uint64_t m_completed;
+      int m_status;
+      bool m_stop;
+};
+
+#endif
@@ -0,0 +1,226 @@
+/*
+   The MIT License(MIT)
+
+   Copyright(c) 2015 Jamal Benbrahim
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files(the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and / or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions :
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+*/
+
+#include "HcThreadPool.hpp"
+
+// The pool and queue of the pool thread running, if any.
+static thread_local HcThreadPool* t_pool = 0;
+static thread_local unsigned int t_queue = 0;
+
+HcThreadPool::HcThreadPool (void)
+{
+   m_pending = 0;
+   m_stop = false;
+   m_queues.push_back (std::unique_ptr<Queue> (new Queue));
+}
+
+HcThreadPool::~HcThreadPool (void)
+{
+   stop ();
+}
+
+// Set the number of threads running the jobs, including the caller of run.  No job may be running.
+bool HcThreadPool::setThreads (unsigned int threads)
+{
+   if (!threads)
+   {
+      return false;
+   }
+
+   if (threads == getThreads ())
+   {
+      return true;
+   }
+
+   stop ();
+
+   try
+   {
+      m_queues.clear ();
+
+      for (unsigned int i = 0; i < threads; ++i)
+      {
+         m_queues.push_back (std::unique_ptr<Queue> (new Queue));
+      }
+
+      for (unsigned int i = 1; i < threads; ++i)
+      {
+         m_threads.push_back (std::thread (&HcThreadPool::worker, this, i - 1));
+      }
+   }
+   catch (...)
+   {
+      stop ();
+      return false;
+   }
+
+   return true;
+}
+
+unsigned int HcThreadPool::getThreads (void)
+{
+   return (unsigned int) m_threads.size () + 1;
+}
+
+// Run task (0) ... task (tasks - 1) over the threads, and return when they are all done.  The caller only works on
+// the tasks of this job, so it is not held up by the jobs of others.
+void HcThreadPool::run (unsigned int tasks, const Task& task)
+{
+   if (!tasks)
+   {
+      return;
+   }
+
+   Job job;
+   unsigned int queue = (t_pool == this) ? t_queue : (unsigned int) m_queues.size () - 1;
+
+   job.m_task = &task;
+   job.m_left = tasks;
+
+   {
+      std::lock_guard<std::mutex> lock (m_queues[queue]->m_mutex);
+
+      // The caller takes the first tasks from the back, while the others steal the last ones from the front.
+      for (unsigned int i = tasks; i--; )
+      {
+         m_queues[queue]->m_items.push_back (Item { &job, i });
+      }
+   }
+
+   {
+      std::lock_guard<std::mutex> lock (m_mutex);
+      m_pending += tasks;
+   }
+
+   m_wake.notify_all ();
+
+   Item item;
+
+   while (take (queue, &job, item))
+   {
+      execute (item);
+   }
+
+   std::unique_lock<std::mutex> lock (m_mutex);
+
+   m_done.wait (lock, [&job] { return !job.m_left; });
+}
+
+// Stop and join all the threads.
+void HcThreadPool::stop (void)
+{
+   {
+      std::lock_guard<std::mutex> lock (m_mutex);
+      m_stop = true;
+   }
+
+   m_wake.notify_all ();
+
+   for (auto& t : m_threads)
+   {
+      t.join ();
+   }
+
+   m_threads.clear ();
+   m_queues.resize (1);
+   m_stop = false;
+}
+
+void HcThreadPool::worker (unsigned int queue)
+{
+   t_pool = this;
+   t_queue = queue;
+
+   for (;;)
+   {
+      Item item;
+
+      if (take (queue, 0, item) || steal (queue, item))
+      {
+         execute (item);
+         continue;
+      }
+
+      std::unique_lock<std::mutex> lock (m_mutex);
+
+      m_wake.wait (lock, [this] { return m_stop || m_pending; });
+
+      if (m_stop)
+      {
+         return;
+      }
+   }
+}
+
+// Take the last task of a queue, or the last one of job if given.
+bool HcThreadPool::take (unsigned int queue, const Job* job, Item& item)
+{
+   std::lock_guard<std::mutex> lock (m_queues[queue]->m_mutex);
+   std::deque<Item>& items = m_queues[queue]->m_items;
+
+   for (auto it = items.rbegin (); it != items.rend (); ++it)
+   {
+      if (!job || (it->m_job == job))
+      {
+         item = *it;
+         items.erase (std::next (it).base ());
+         --m_pending;
+         return true;
+      }
+   }
+
+   return false;
+}
+
+// Steal the first task of another queue.
+bool HcThreadPool::steal (unsigned int queue, Item& item)
+{
+   for (size_t i = 1; i < m_queues.size (); ++i)
+   {
+      Queue& other = *m_queues[(queue + i) % m_queues.size ()];
+      std::lock_guard<std::mutex> lock (other.m_mutex);
+
+      if (!other.m_items.empty ())
+      {
+         item = other.m_items.front ();
+         other.m_items.pop_front ();
+         --m_pending;
+         return true;
+      }
+   }
+
+   return false;
+}
+
+void HcThreadPool::execute (const Item& item)
+{
+   (*item.m_job->m_task) (item.m_index);
+
+   // The job may be gone as soon as its last task is counted.
+   if (1 == item.m_job->m_left--)
+   {
+      std::lock_guard<std::mutex> lock (m_mutex);
+      m_done.notify_all ();
+   }
+}
@@ -0,0 +1,93 @@
+/*
+   The MIT License(MIT)
+
+   Copyright(c) 2015 Jamal Benbrahim
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files(the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and / or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions :
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+*/
+
+#ifndef __HCTHREADPOOL_HPP__
+#define __HCTHREADPOOL_HPP__
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+   A fixed set of threads that run the tasks of jobs in parallel.  The thread calling run works on its job too, so a
+   pool of N threads starts N - 1 of its own.  Several threads can run jobs at the same time, and a task can run a
+   job of its own: every thread queues the tasks of its jobs, and the idle threads steal tasks from the others.
+*/
+class HcThreadPool
+{
+   public:
+      typedef std::function<void (unsigned int task)> Task;
+
+      HcThreadPool (void);
+      ~HcThreadPool (void);
+
+      bool setThreads (unsigned int threads);
+      unsigned int getThreads (void);
+
+      void run (unsigned int tasks, const Task& task);
+
+   private:
+      // The tasks of one call to run, and how many of them are not done yet.
+      struct Job
+      {
+         const Task* m_task;
+         std::atomic<unsigned int> m_left;
+      };
+
+      struct Item
+      {
+         Job* m_job;
+         unsigned int m_index;
+      };
+
+      // A thread takes the tasks of its own jobs from the back of its queue, and steals from the front of the others.
+      // The threads that are not in the pool share the last queue.
+      struct Queue
+      {
+         std::mutex m_mutex;
+         std::deque<Item> m_items;
+      };
+
+      void stop (void);
+      void worker (unsigned int queue);
+      bool take (unsigned int queue, const Job* job, Item& item);
+      bool steal (unsigned int queue, Item& item);
+      void execute (const Item& item);
+
+      std::vector<std::thread> m_threads;
+      std::vector<std::unique_ptr<Queue> > m_queues;
+      std::mutex m_mutex;
+      std::condition_variable m_wake;
+      std::condition_variable m_done;
+
+      std::atomic<unsigned int> m_pending;
+      bool m_stop;
+};
+
+#endif
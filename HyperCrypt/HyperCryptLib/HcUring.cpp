@@ -0,0 +1,469 @@
+/*
+   The MIT License(MIT)
+
+   Copyright(c) 2015 Jamal Benbrahim
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files(the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and / or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions :
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+*/
+
+#include "HcUring.hpp"
+
+#if defined(__linux__) && !defined(HC_NO_IO_URING) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HC_HAVE_IO_URING
+#endif
+#endif
+
+#ifdef HC_HAVE_IO_URING
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+static int uring_setup (unsigned int entries, struct io_uring_params* params)
+{
+   return (int) syscall (__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter (int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags)
+{
+   return (int) syscall (__NR_io_uring_enter, fd, to_submit, min_complete, flags, 0, 0);
+}
+
+static int uring_register (int fd, unsigned int opcode, void* arg, unsigned int count)
+{
+   return (int) syscall (__NR_io_uring_register, fd, opcode, arg, count);
+}
+#endif
+
+HcUring::HcUring (void)
+{
+   m_fd = -1;
+   m_sq_ring = 0;
+   m_sq_ring_size = 0;
+   m_cq_ring = 0;
+   m_cq_ring_size = 0;
+   m_sqes = 0;
+   m_sqes_size = 0;
+   m_sq_tail = 0;
+   m_sq_mask = 0;
+   m_sq_array = 0;
+   m_cq_head = 0;
+   m_cq_tail = 0;
+   m_cq_mask = 0;
+   m_cqes = 0;
+   m_in_flight = 0;
+   m_fixed_size = 0;
+}
+
+HcUring::~HcUring (void)
+{
+   close ();
+}
+
+// Set up a ring of entries requests in flight, and the given number of groups.
+bool HcUring::open (unsigned int entries, unsigned int groups)
+{
+   close ();
+
+#ifdef HC_HAVE_IO_URING
+   struct io_uring_params params;
+
+   memset (&params, 0, sizeof (params));
+
+   m_fd = uring_setup (entries, &params);
+
+   if (m_fd < 0)
+   {
+      m_fd = -1;
+      return false;
+   }
+
+   // Only kernels that can read and write without an iovec will do.
+   size_t probe_size = sizeof (struct io_uring_probe) + 256 * sizeof (struct io_uring_probe_op);
+   struct io_uring_probe* probe = (struct io_uring_probe*) calloc (1, probe_size);
+   bool supported = probe && (uring_register (m_fd, IORING_REGISTER_PROBE, probe, 256) >= 0) &&
+                    (probe->last_op >= IORING_OP_WRITE) &&
+                    (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) &&
+                    (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED);
+
+   free (probe);
+
+   if (!supported)
+   {
+      close ();
+      return false;
+   }
+
+   m_sq_ring_size = params.sq_off.array + params.sq_entries * sizeof (unsigned int);
+   m_cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof (struct io_uring_cqe);
+   m_sqes_size = params.sq_entries * sizeof (struct io_uring_sqe);
+
+   // With a single mapping, the completion ring shares the one of the submission ring.
+   if (params.features & IORING_FEAT_SINGLE_MMAP)
+   {
+      if (m_cq_ring_size > m_sq_ring_size)
+      {
+         m_sq_ring_size = m_cq_ring_size;
+      }
+
+      m_cq_ring_size = 0;
+   }
+
+   m_sq_ring = mmap (0, m_sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+   m_cq_ring = m_cq_ring_size ? mmap (0, m_cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING) : m_sq_ring;
+   m_sqes = mmap (0, m_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES);
+
+   if ((MAP_FAILED == m_sq_ring) || (MAP_FAILED == m_cq_ring) || (MAP_FAILED == m_sqes))
+   {
+      close ();
+      return false;
+   }
+
+   uint8_t* sq = (uint8_t*) m_sq_ring;
+   uint8_t* cq = (uint8_t*) m_cq_ring;
+
+   m_sq_tail = (unsigned int*) (sq + params.sq_off.tail);
+   m_sq_mask = (unsigned int*) (sq + params.sq_off.ring_mask);
+   m_sq_array = (unsigned int*) (sq + params.sq_off.array);
+   m_cq_head = (unsigned int*) (cq + params.cq_off.head);
+   m_cq_tail = (unsigned int*) (cq + params.cq_off.tail);
+   m_cq_mask = (unsigned int*) (cq + params.cq_off.ring_mask);
+   m_cqes = cq + params.cq_off.cqes;
+
+   // No more requests are in flight than the completion ring holds, so none are dropped.
+   try
+   {
+      m_requests.resize (params.cq_entries);
+      m_pending.assign (groups, 0);
+      m_failed.assign (groups, false);
+
+      for (uint32_t i = params.cq_entries; i--; )
+      {
+         m_free.push_back (i);
+      }
+   }
+   catch (...)
+   {
+      close ();
+      return false;
+   }
+
+   return true;
+#else
+   (void) entries;
+   (void) groups;
+
+   return false;
+#endif
+}
+
+// Wait for the requests in flight, since they use the buffers of the caller, and let go of the ring.
+void HcUring::close (void)
+{
+#ifdef HC_HAVE_IO_URING
+   while (m_in_flight && reap ())
+   {
+   }
+
+   if (m_sqes && (MAP_FAILED != m_sqes))
+   {
+      munmap (m_sqes, m_sqes_size);
+   }
+
+   if (m_cq_ring && (MAP_FAILED != m_cq_ring) && (m_cq_ring != m_sq_ring))
+   {
+      munmap (m_cq_ring, m_cq_ring_size);
+   }
+
+   if (m_sq_ring && (MAP_FAILED != m_sq_ring))
+   {
+      munmap (m_sq_ring, m_sq_ring_size);
+   }
+
+   if (m_fd >= 0)
+   {
+      ::close (m_fd);
+   }
+#endif
+
+   m_fd = -1;
+   m_sq_ring = 0;
+   m_cq_ring = 0;
+   m_sqes = 0;
+   m_requests.clear ();
+   m_free.clear ();
+   m_pending.clear ();
+   m_failed.clear ();
+   m_in_flight = 0;
+   m_fixed.clear ();
+   m_fixed_size = 0;
+}
+
+bool HcUring::isOpen (void)
+{
+   return m_fd >= 0;
+}
+
+// Register count buffers of size bytes, which the transfers in them then use.  This is only a speed up, and can fail
+// when the locked memory limit is too low.
+bool HcUring::registerBuffers (uint8_t* const* buffers, unsigned int count, size_t size)
+{
+#ifdef HC_HAVE_IO_URING
+   std::vector<struct iovec> iovecs (count);
+
+   if (!isOpen () || !count || !m_fixed.empty ())
+   {
+      return false;
+   }
+
+   for (unsigned int i = 0; i < count; ++i)
+   {
+      iovecs[i].iov_base = buffers[i];
+      iovecs[i].iov_len = size;
+   }
+
+   if (uring_register (m_fd, IORING_REGISTER_BUFFERS, &iovecs[0], count) < 0)
+   {
+      return false;
+   }
+
+   m_fixed.assign (buffers, buffers + count);
+   m_fixed_size = size;
+
+   return true;
+#else
+   (void) buffers;
+   (void) count;
+   (void) size;
+
+   return false;
+#endif
+}
+
+// Start reading or writing size bytes of a file at offset, as part of group.
+bool HcUring::submit (unsigned int group, int fd, uint8_t* buffer, size_t size, uint64_t offset, bool write)
+{
+   if (!isOpen () || (group >= m_pending.size ()))
+   {
+      return false;
+   }
+
+   while (size)
+   {
+      // Make room for the request by waiting for another one.
+      while (m_free.empty ())
+      {
+         if (!reap ())
+         {
+            return false;
+         }
+      }
+
+      uint32_t index = m_free.back ();
+      Request& request = m_requests[index];
+
+      request.m_group = group;
+      request.m_fd = fd;
+      request.m_buffer = buffer;
+      request.m_size = (uint32_t) ((size > REQUEST_SIZE) ? REQUEST_SIZE : size);
+      request.m_offset = offset;
+      request.m_write = write;
+
+      m_free.pop_back ();
+      ++m_pending[group];
+      ++m_in_flight;
+
+      if (!push (index))
+      {
+         finish (index, true);
+         return false;
+      }
+
+      buffer += request.m_size;
+      offset += request.m_size;
+      size -= request.m_size;
+   }
+
+   return true;
+}
+
+// Wait for every transfer of group to be done.  Return false if any of them failed.
+bool HcUring::wait (unsigned int group)
+{
+   if (group >= m_pending.size ())
+   {
+      return false;
+   }
+
+   while (m_pending[group])
+   {
+      if (!reap ())
+      {
+         return false;
+      }
+   }
+
+   bool failed = m_failed[group];
+
+   m_failed[group] = false;
+
+   return !failed;
+}
+
+// Put a request on the submission ring, and hand it to the kernel.
+bool HcUring::push (uint32_t index)
+{
+#ifdef HC_HAVE_IO_URING
+   const Request& request = m_requests[index];
+   unsigned int tail = *m_sq_tail;
+   unsigned int slot = tail & *m_sq_mask;
+   struct io_uring_sqe* sqe = (struct io_uring_sqe*) m_sqes + slot;
+   int fixed = getFixedIndex (request);
+
+   memset (sqe, 0, sizeof (*sqe));
+
+   if (fixed >= 0)
+   {
+      sqe->opcode = request.m_write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+      sqe->buf_index = (uint16_t) fixed;
+   }
+   else
+   {
+      sqe->opcode = request.m_write ? IORING_OP_WRITE : IORING_OP_READ;
+   }
+
+   sqe->fd = request.m_fd;
+   sqe->off = request.m_offset;
+   sqe->addr = (uint64_t) (uintptr_t) request.m_buffer;
+   sqe->len = request.m_size;
+   sqe->user_data = index;
+
+   m_sq_array[slot] = slot;
+   __atomic_store_n (m_sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+   // Every request is submitted right away, so the submission ring is empty again once this returns.
+   for (;;)
+   {
+      int res = uring_enter (m_fd, 1, 0, 0);
+
+      if (res >= 0)
+      {
+         return 1 == res;
+      }
+
+      if (EINTR != errno)
+      {
+         return false;
+      }
+   }
+#else
+   (void) index;
+
+   return false;
+#endif
+}
+
+// Wait for the next request to complete.  A short transfer is submitted again for what is left.
+bool HcUring::reap (void)
+{
+#ifdef HC_HAVE_IO_URING
+   unsigned int head = *m_cq_head;
+
+   while (head == __atomic_load_n (m_cq_tail, __ATOMIC_ACQUIRE))
+   {
+      if ((uring_enter (m_fd, 0, 1, IORING_ENTER_GETEVENTS) < 0) && (EINTR != errno))
+      {
+         return false;
+      }
+   }
+
+   const struct io_uring_cqe* cqe = (const struct io_uring_cqe*) m_cqes + (head & *m_cq_mask);
+   uint32_t index = (uint32_t) cqe->user_data;
+   int res = cqe->res;
+
+   __atomic_store_n (m_cq_head, head + 1, __ATOMIC_RELEASE);
+
+   if (index >= m_requests.size ())
+   {
+      return false;
+   }
+
+   Request& request = m_requests[index];
+
+   if ((-EINTR == res) || (-EAGAIN == res))
+   {
+      res = 0;
+   }
+   else if (res <= 0)
+   {
+      finish (index, true);
+      return true;
+   }
+
+   request.m_buffer += res;
+   request.m_offset += res;
+   request.m_size -= (uint32_t) res;
+
+   if (!request.m_size)
+   {
+      finish (index, false);
+   }
+   else if (!push (index))
+   {
+      finish (index, true);
+   }
+
+   return true;
+#else
+   return false;
+#endif
+}
+
+void HcUring::finish (uint32_t index, bool failed)
+{
+   Request& request = m_requests[index];
+
+   if (failed)
+   {
+      m_failed[request.m_group] = true;
+   }
+
+   --m_pending[request.m_group];
+   --m_in_flight;
+   m_free.push_back (index);
+}
+
+// Get the registered buffer a request is in, or -1.
+int HcUring::getFixedIndex (const Request& request)
+{
+   for (size_t i = 0; i < m_fixed.size (); ++i)
+   {
+      if ((request.m_buffer >= m_fixed[i]) && (request.m_buffer + request.m_size <= m_fixed[i] + m_fixed_size))
+      {
+         return (int) i;
+      }
+   }
+
+   return -1;
+}
@@ -0,0 +1,99 @@
+/*
+   The MIT License(MIT)
+
+   Copyright(c) 2015 Jamal Benbrahim
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files(the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and / or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions :
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+*/
+
+#ifndef __HCURING_HPP__
+#define __HCURING_HPP__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+/*
+   Reads and writes files through a Linux io_uring, set up with the raw system calls, so several large transfers are
+   in flight at once.  Every transfer belongs to a group, such as the transfers of one buffer, and the caller waits for
+   a group before it reuses its buffer.  Transfers are cut into requests of up to REQUEST_SIZE bytes, and short ones
+   are resubmitted.  Elsewhere, or when the kernel does not have io_uring, open fails and the caller does its own I/O.
+   A ring is used by one thread.
+*/
+class HcUring
+{
+   public:
+      enum { REQUEST_SIZE = 1024 * 1024 };
+
+      HcUring (void);
+      ~HcUring (void);
+
+      bool open (unsigned int entries, unsigned int groups);
+      void close (void);
+      bool isOpen (void);
+
+      bool registerBuffers (uint8_t* const* buffers, unsigned int count, size_t size);
+
+      bool submit (unsigned int group, int fd, uint8_t* buffer, size_t size, uint64_t offset, bool write);
+      bool wait (unsigned int group);
+
+   private:
+      struct Request
+      {
+         unsigned int m_group;
+         int m_fd;
+         uint8_t* m_buffer;
+         uint32_t m_size;
+         uint64_t m_offset;
+         bool m_write;
+      };
+
+      bool push (uint32_t request);
+      bool reap (void);
+      void finish (uint32_t request, bool failed);
+      int getFixedIndex (const Request& request);
+
+      int m_fd;
+      void* m_sq_ring;
+      size_t m_sq_ring_size;
+      void* m_cq_ring;
+      size_t m_cq_ring_size;
+      void* m_sqes;
+      size_t m_sqes_size;
+
+      unsigned int* m_sq_tail;
+      unsigned int* m_sq_mask;
+      unsigned int* m_sq_array;
+      unsigned int* m_cq_head;
+      unsigned int* m_cq_tail;
+      unsigned int* m_cq_mask;
+      void* m_cqes;
+
+      std::vector<Request> m_requests;
+      std::vector<uint32_t> m_free;
+      std::vector<unsigned int> m_pending;
+      std::vector<bool> m_failed;
+      unsigned int m_in_flight;
+
+      // The buffers registered with the kernel, which are read into and written from without mapping them each time.
+      std::vector<uint8_t*> m_fixed;
+      size_t m_fixed_size;
+};
+
+#endif
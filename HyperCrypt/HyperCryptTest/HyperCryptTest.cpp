@@ -0,0 +1,1097 @@
+/*
+   The MIT License(MIT)
+
+   Copyright(c) 2015 Jamal Benbrahim
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files(the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and / or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions :
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+*/
+
+/*
+   Round-trip tests of the engine.  They run in a temporary directory, since the engine writes its outputs to the
+   current one, and exit with 1 if any of them fails.  The path of the hypercrypt tool can be given, for the tests that
+   run it.  With "bench", the single-level and two-level shuffles are timed instead.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <boost/filesystem.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "HcEngine.hpp"
+#include "HcLfsr.hpp"
+#include "HcLfsrBank.hpp"
+#include "HcShuffler.hpp"
+
+static std::atomic<int> failures (0);
+
+// The hypercrypt command line tool, when given, for the tests that run it.
+static std::string cli_path;
+
+#define CHECK(x)\
+   if (!(x))\
+   {\
+      printf ("   failed: %s (%s:%d)\n", #x, __FILE__, __LINE__);\
+      ++failures;\
+      return false;\
+   }
+
+// Write size pseudo random bytes, which depend on seed, to a new file.
+static bool write_file (const std::string& file_name, size_t size, unsigned seed)
+{
+   std::mt19937 gen (seed);
+   std::vector<char> data (std::min (size, (size_t) 1024 * 1024));
+   std::ofstream out (file_name, std::ios::binary);
+
+   while (size && out.good ())
+   {
+      size_t count = std::min (size, data.size ());
+
+      for (size_t i = 0; i < count; ++i)
+      {
+         data[i] = (char) gen ();
+      }
+
+      out.write (data.data (), count);
+      size -= count;
+   }
+
+   return out.good ();
+}
+
+// Whether two files have the same bytes, read a piece at a time so big files can be compared.
+static bool same_files (const std::string& a, const std::string& b)
+{
+   std::ifstream in_a (a, std::ios::binary);
+   std::ifstream in_b (b, std::ios::binary);
+   std::vector<char> data_a (1024 * 1024);
+   std::vector<char> data_b (data_a.size ());
+
+   if (!in_a || !in_b)
+   {
+      return false;
+   }
+
+   while (in_a && in_b)
+   {
+      in_a.read (data_a.data (), data_a.size ());
+      in_b.read (data_b.data (), data_b.size ());
+
+      if ((in_a.gcount () != in_b.gcount ()) || memcmp (data_a.data (), data_b.data (), (size_t) in_a.gcount ()))
+      {
+         return false;
+      }
+   }
+
+   return !in_a && !in_b;
+}
+
+// Remove file_name and everything encrypting it may have left.
+static void remove_files (const std::string& file_name, unsigned long splits)
+{
+   boost::system::error_code ec;
+
+   for (auto& e : { file_name, file_name + ".orig", file_name + ".hckey", file_name + ".hc" })
+   {
+      boost::filesystem::remove (e, ec);
+   }
+
+   for (unsigned long i = 0; i < splits; ++i)
+   {
+      char temp[64];
+
+      sprintf (temp, ".%02d.hc", (int) (i + 1));
+      boost::filesystem::remove (file_name + temp, ec);
+   }
+}
+
+// Set up an engine before it encrypts, and again before it decrypts.
+typedef std::function<void (HcEngine* engine, bool decrypt)> EngineSetup;
+
+/*
+   Encrypt file_name and decrypt it with an engine set up by setup, then check that the output matches the input.  The
+   input is moved aside while decrypting, and everything is removed afterwards.
+*/
+static bool round_trip (const std::string& file_name, size_t size, unsigned seed, unsigned long splits,
+                        const EngineSetup& setup)
+{
+   std::string orig_name = file_name + ".orig";
+
+   CHECK (write_file (file_name, size, seed));
+
+   HcEngine* engine = HcEngine::create ();
+
+   CHECK (engine);
+
+   setup (engine, false);
+
+   HcStatus status = engine->encryptFile (splits, file_name.c_str (), 0, 0);
+
+   boost::filesystem::rename (file_name, orig_name);
+
+   if (HC_STATUS_OK == status)
+   {
+      setup (engine, true);
+      status = engine->decryptFile (splits, (file_name + ".hckey").c_str (), 0, 0);
+   }
+
+   HcEngine::destroy (engine);
+
+   bool same = (boost::filesystem::exists (file_name) && (boost::filesystem::file_size (file_name) == size) &&
+                same_files (file_name, orig_name));
+
+   remove_files (file_name, splits);
+
+   CHECK (HC_STATUS_OK == status);
+   CHECK (same);
+
+   return true;
+}
+
+// Round trip with encrypt_threads threads to encrypt and decrypt_threads to decrypt.
+static bool round_trip (const std::string& file_name, size_t size, unsigned seed, unsigned long splits,
+                        unsigned long encrypt_threads, unsigned long decrypt_threads)
+{
+   return round_trip (file_name, size, seed, splits, [=] (HcEngine* engine, bool decrypt)
+   {
+      engine->setThreads (decrypt ? decrypt_threads : encrypt_threads);
+   });
+}
+
+// The sequence widths the LFSR tests cover: the smallest, a few in between, and one near the top.
+static const uint32_t lfsr_bits[] = { 8, 12, 17, 23 };
+
+// Set a and b to the same sequence of the given width.
+static bool same_lfsrs (HcLfsr& a, HcLfsr& b, uint32_t bits, int variant)
+{
+   return a.reset (1u << bits, 0, variant) && b.setSpec (a.getSpec ());
+}
+
+// Skipping or seeking n steps lands where stepping n times does, including past a full period.
+static bool test_lfsr_skip (void)
+{
+   for (uint32_t bits : lfsr_bits)
+   {
+      unsigned long long period = (1ull << bits) - 1;
+
+      for (int variant = 0; variant < 3; ++variant)
+      {
+         HcLfsr stepped (0), skipped (0), sought (0);
+
+         CHECK (same_lfsrs (stepped, skipped, bits, variant));
+         CHECK (sought.setSpec (stepped.getSpec ()));
+
+         uint64_t position = 0;
+
+         for (unsigned long long n : { 0ull, 1ull, 7ull, 8ull, 255ull, 1000ull, period - 1, period + 3 })
+         {
+            for (uint64_t i = 0; i < n; ++i)
+            {
+               stepped.getNext ();
+            }
+
+            position += n;
+
+            if (n)
+            {
+               CHECK (skipped.skip (n));
+            }
+
+            CHECK (sought.seekTo (position));
+
+            uint32_t next = stepped.getNext ();
+
+            CHECK (next == skipped.getNext ());
+            CHECK (next == sought.getNext ());
+
+            ++position;
+         }
+      }
+   }
+
+   return true;
+}
+
+// The table driven fillNext gives the same numbers as stepping a bit at a time, for counts that are not whole bytes too.
+static bool test_lfsr_fill (void)
+{
+   for (uint32_t bits : lfsr_bits)
+   {
+      for (int variant = 0; variant < 3; ++variant)
+      {
+         HcLfsr stepped (0), filled (0);
+
+         CHECK (same_lfsrs (stepped, filled, bits, variant));
+
+         for (uint32_t count : { 1u, 7u, 8u, 13u, 64u, 1003u })
+         {
+            std::vector<uint32_t> buffer (count);
+
+            CHECK (filled.fillNext (buffer.data (), count));
+
+            for (uint32_t i = 0; i < count; ++i)
+            {
+               CHECK (buffer[i] == stepped.getNext ());
+            }
+         }
+
+         // Both carry on from the same place.
+         CHECK (filled.getNext () == stepped.getNext ());
+      }
+   }
+
+   return true;
+}
+
+// Check that every active lane of bank gives the numbers of its scalar LFSR in lanes, through skips and fills.
+static bool same_lanes (HcLfsrBank& bank, std::vector<HcLfsr>& lanes)
+{
+   for (uint32_t count : { 13u, 1003u, 8u })
+   {
+      std::vector<uint32_t> buffer (count * HcLfsrBank::LANES);
+
+      CHECK (bank.fillNext (buffer.data (), count));
+
+      for (uint32_t lane = 0; lane < lanes.size (); ++lane)
+      {
+         for (uint32_t i = 0; i < count; ++i)
+         {
+            CHECK (buffer[i * HcLfsrBank::LANES + lane] == lanes[lane].getNext ());
+         }
+      }
+
+      CHECK (bank.skip (count * 3 + 1));
+
+      for (auto& lfsr : lanes)
+      {
+         CHECK (lfsr.skip (count * 3 + 1));
+      }
+   }
+
+   return true;
+}
+
+// Every lane of an LFSR bank, whatever kernel it runs on, matches a scalar LFSR.
+static bool test_lfsr_bank (void)
+{
+   // One sequence split over some or all the lanes, as the engine uses it.
+   for (uint32_t bits : lfsr_bits)
+   {
+      for (uint32_t lane_count : { 5u, (uint32_t) HcLfsrBank::LANES })
+      {
+         HcLfsr lfsr (0);
+
+         CHECK (lfsr.reset (1u << bits, 0, (int) lane_count));
+
+         HcLfsrBank bank;
+         std::vector<HcLfsr> lanes (lane_count, HcLfsr (0));
+
+         CHECK (bank.setLanes (lfsr, 100, 37, lane_count));
+
+         for (uint32_t lane = 0; lane < lane_count; ++lane)
+         {
+            CHECK (lanes[lane].setSpec (lfsr.getSpec ()));
+            CHECK (lanes[lane].seekTo (100 + lane * 37));
+         }
+
+         if (!same_lanes (bank, lanes))
+         {
+            return false;
+         }
+      }
+   }
+
+   // A different sequence and width in every lane.
+   HcLfsrBank bank;
+   std::vector<HcLfsr> lanes (HcLfsrBank::LANES, HcLfsr (0));
+
+   for (uint32_t lane = 0; lane < HcLfsrBank::LANES; ++lane)
+   {
+      HcLfsr lfsr (0);
+      uint32_t bits = lfsr_bits[lane % (sizeof (lfsr_bits) / sizeof (lfsr_bits[0]))];
+
+      CHECK (lfsr.reset (1u << bits, 0, (int) lane));
+      CHECK (bank.setLane (lane, lfsr, lane * 11));
+      CHECK (lanes[lane].setSpec (lfsr.getSpec ()));
+      CHECK (lanes[lane].seekTo (lane * 11));
+   }
+
+   if (!same_lanes (bank, lanes))
+   {
+      return false;
+   }
+
+   printf ("   lfsr bank kernel: %s\n", HcLfsrBank::getEngineName ());
+
+   return true;
+}
+
+/*
+   Check that shuffling the first size bytes of a segment of out_size bytes sends every byte to its own place in the
+   segment.  When size is out_size, every place gets exactly one byte.
+*/
+static bool is_permutation (HcShuffler& shuffler, uint32_t size, uint32_t out_size)
+{
+   std::vector<uint8_t> segment (out_size);
+   std::vector<uint8_t> hits (out_size);
+   uint32_t chunk_count = (size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+   HcChunkMap map;
+
+   CHECK (shuffler.start (size, 0));
+
+   for (uint32_t c = 0; c < chunk_count; ++c)
+   {
+      CHECK (shuffler.next (segment.data (), map));
+
+      size_t base = map.m_base - segment.data ();
+
+      for (uint32_t i = 0; i < CHUNK_SIZE; ++i)
+      {
+         size_t place = base + ((map.m_last && (CHUNK_SIZE - 1 == i)) ? 0 : map.m_indices[i * map.m_stride]);
+
+         CHECK (place < out_size);
+         CHECK (!hits[place]++);
+      }
+   }
+
+   // Nothing is left over.
+   CHECK (!shuffler.next (segment.data (), map));
+
+   if (size == out_size)
+   {
+      CHECK (std::all_of (hits.begin (), hits.end (), [](uint8_t h) { return 1 == h; }));
+   }
+
+   return true;
+}
+
+// The segment sizes the shuffler tests cover, as { size, out_size }: whole segments, then tails in bigger segments.
+static const std::pair<uint32_t, uint32_t> shuffle_sizes[] =
+{
+   { 256, 256 }, { 4096, 4096 }, { 1 << 20, 1 << 20 }, { 2 << 20, 2 << 20 },
+   { 1000, 1024 }, { 4096 - 3 * 256, 4096 }, { (1 << 20) - 5 * 256, 1 << 20 }, { 600000, 1 << 20 },
+   { (1 << 20) + 12345, 2 << 20 },
+};
+
+// Every shuffle sends every byte of a segment to its own place, for the smallest, odd and biggest sizes it takes.
+static bool test_shuffle_permutations (void)
+{
+   std::mt19937 random (9);
+
+   for (auto& sizes : shuffle_sizes)
+   {
+      HcLfsr lfsr (0);
+      HcLfsrShuffler lfsr_shuffler;
+
+      CHECK (lfsr.reset (sizes.second, 0, -1));
+      CHECK (lfsr_shuffler.setSpec (lfsr.getSpec ()));
+
+      if (!is_permutation (lfsr_shuffler, sizes.first, sizes.second))
+      {
+         printf ("   lfsr shuffle of %u in %u\n", sizes.first, sizes.second);
+         return false;
+      }
+
+      if (sizes.second >= TWO_LEVEL_MIN_SIZE)
+      {
+         HcLfsr byte_lfsr (0);
+         HcTwoLevelShuffler two_level_shuffler;
+
+         CHECK (lfsr.reset (sizes.second / TWO_LEVEL_BLOCK_SIZE, 0, -1));
+         CHECK (byte_lfsr.reset (TWO_LEVEL_BLOCK_SIZE, 0, -1));
+         CHECK (two_level_shuffler.setSpec (lfsr.getSpec (), byte_lfsr.getSpec (), sizes.second));
+
+         if (!is_permutation (two_level_shuffler, sizes.first, sizes.second))
+         {
+            printf ("   two-level shuffle of %u in %u\n", sizes.first, sizes.second);
+            return false;
+         }
+      }
+
+      uint8_t key[FEISTEL_KEY_SIZE];
+      HcFeistelShuffler feistel_shuffler;
+
+      for (auto& k : key)
+      {
+         k = (uint8_t) random ();
+      }
+
+      CHECK (feistel_shuffler.setKey (key, sizes.second));
+
+      if (!is_permutation (feistel_shuffler, sizes.first, sizes.second))
+      {
+         printf ("   feistel shuffle of %u in %u\n", sizes.first, sizes.second);
+         return false;
+      }
+   }
+
+   return true;
+}
+
+// Several engines, each on its own thread, encrypt and decrypt different files at the same time.
+static bool test_engine_per_thread (void)
+{
+   const size_t sizes[] = { 1, 300, 70000, 1 << 20, 3000000, 5 << 20 };
+   const size_t count = sizeof (sizes) / sizeof (sizes[0]);
+
+   std::vector<std::thread> threads;
+   std::atomic<int> passed (0);
+
+   for (size_t i = 0; i < count; ++i)
+   {
+      threads.emplace_back ([&passed, &sizes, i] ()
+      {
+         std::string file_name = "engine-" + std::to_string (i);
+
+         // Every other engine splits its output.
+         if (round_trip (file_name, sizes[i], (unsigned) i, (i & 1) ? 3 : 0, 1, 1))
+         {
+            ++passed;
+         }
+      });
+   }
+
+   for (auto& e : threads)
+   {
+      e.join ();
+   }
+
+   CHECK (count == (size_t) passed);
+
+   return true;
+}
+
+// Files encrypted with one number of threads decrypt with another, split or not.
+static bool test_thread_counts (void)
+{
+   const struct
+   {
+      size_t size;
+      unsigned long splits;
+      unsigned long encrypt_threads;
+      unsigned long decrypt_threads;
+   }
+   cases[] =
+   {
+      { 300,        0, 4, 4 },
+      { 3000000,    0, 1, 4 },
+      { 3000000,    0, 4, 1 },
+      { 3000000,    3, 4, 2 },
+      { 20 << 20,   0, 0, 3 },
+      { 20 << 20,   0, 3, 0 },
+      { 20 << 20,   4, 8, 8 },
+   };
+
+   bool ok = true;
+
+   for (auto& e : cases)
+   {
+      if (!round_trip ("threads", e.size, (unsigned) e.size, e.splits, e.encrypt_threads, e.decrypt_threads))
+      {
+         printf ("   %lu bytes, %lu splits, %lu -> %lu threads\n", (unsigned long) e.size, e.splits,
+                 e.encrypt_threads, e.decrypt_threads);
+         ok = false;
+      }
+   }
+
+   return ok;
+}
+
+// Count the segments of a key file.
+static size_t count_segments (const std::string& key_file_name)
+{
+   std::ifstream in (key_file_name, std::ios::binary);
+   std::string xml ((std::istreambuf_iterator<char> (in)), std::istreambuf_iterator<char> ());
+   size_t count = 0;
+
+   for (size_t pos = xml.find ("<Segment>"); std::string::npos != pos; pos = xml.find ("<Segment>", pos + 1))
+   {
+      ++count;
+   }
+
+   return count;
+}
+
+// The sizing policies give at least the segments asked for, as many as there can be when that is too many, and the
+// cache policy turns down sizes too small to be useful.
+static bool test_segment_sizing (void)
+{
+   const struct
+   {
+      HcSegmentSizing sizing;
+      unsigned long param;
+      size_t size;
+      size_t min_segments;
+      size_t max_segments;
+   }
+   cases[] =
+   {
+      { HC_SEGMENT_SIZING_THREADS, 16,      40 << 20,       16,   32 },
+      { HC_SEGMENT_SIZING_THREADS, 1000000, (1 << 20) + 100, 4097, 4097 },
+      { HC_SEGMENT_SIZING_CACHE,   4096,    1 << 20,        256,  264 },
+   };
+
+   HcEngine* engine = HcEngine::create ();
+
+   CHECK (engine);
+   CHECK (!engine->setSegmentSizing (HC_SEGMENT_SIZING_CACHE, 100));
+   CHECK (engine->setSegmentSizing (HC_SEGMENT_SIZING_CACHE, 0));
+
+   HcEngine::destroy (engine);
+
+   for (auto& e : cases)
+   {
+      size_t segments = 0;
+
+      bool ok = round_trip ("sizing", e.size, 7, 0, [&] (HcEngine* engine, bool decrypt)
+      {
+         if (decrypt)
+         {
+            segments = count_segments ("sizing.hckey");
+         }
+         else
+         {
+            engine->setSegmentSizing (e.sizing, e.param);
+         }
+      });
+
+      CHECK (ok);
+      CHECK ((segments >= e.min_segments) && (segments <= e.max_segments));
+   }
+
+   return true;
+}
+
+// Round trips with cipher, whole and split, on one thread and several, for a small file and one of several segments.
+static bool cipher_round_trips (HcCipher cipher)
+{
+   for (size_t size : { (size_t) 1000, (size_t) 5 << 20 })
+   {
+      for (unsigned long splits : { 0ul, 3ul })
+      {
+         for (unsigned long threads : { 1ul, 4ul })
+         {
+            if (!round_trip ("cipher", size, (unsigned) (size + splits + threads), splits, [=] (HcEngine* engine, bool)
+            {
+               engine->setCipher (cipher);
+               engine->setThreads (threads);
+            }))
+            {
+               printf ("   %lu bytes, %lu splits, %lu threads\n", (unsigned long) size, splits, threads);
+               return false;
+            }
+         }
+      }
+   }
+
+   return true;
+}
+
+// Flipping one byte of a file encrypted with a tagged cipher fails decrypting it, and leaves no output behind.
+static bool tampered_decrypt_fails (HcCipher cipher)
+{
+   const size_t size = 5 << 20;
+
+   for (unsigned long threads : { 1ul, 4ul })
+   {
+      CHECK (write_file ("tamper", size, 5));
+
+      HcEngine* engine = HcEngine::create ();
+
+      CHECK (engine);
+      CHECK (engine->setCipher (cipher));
+      CHECK (engine->setThreads (threads));
+      CHECK (HC_STATUS_OK == engine->encryptFile (0, "tamper", 0, 0));
+
+      boost::filesystem::remove ("tamper");
+
+      {
+         std::fstream hc ("tamper.hc", std::ios::in | std::ios::out | std::ios::binary);
+         char c = 0;
+
+         hc.seekg (size / 3);
+         hc.get (c);
+         hc.seekp (size / 3);
+         hc.put ((char) (c ^ 0x10));
+      }
+
+      HcStatus status = engine->decryptFile (0, "tamper.hckey", 0, 0);
+
+      HcEngine::destroy (engine);
+
+      bool written = boost::filesystem::exists ("tamper");
+
+      remove_files ("tamper", 0);
+
+      CHECK (HC_ERROR_CANNOT_DECRYPT_SECTION == status);
+      CHECK (!written);
+   }
+
+   return true;
+}
+
+// Every AES scheme round trips, and GCM catches a changed byte.
+static bool test_aes_ciphers (void)
+{
+   for (HcCipher cipher : { HC_CIPHER_AES_256_CBC, HC_CIPHER_AES_256_CTR, HC_CIPHER_AES_256_GCM })
+   {
+      if (!cipher_round_trips (cipher))
+      {
+         return false;
+      }
+   }
+
+   return tampered_decrypt_fails (HC_CIPHER_AES_256_GCM);
+}
+
+// Both ChaCha20 schemes round trip, and Poly1305 catches a changed byte, when openssl has them.
+static bool test_chacha20_ciphers (void)
+{
+   HcEngine* engine = HcEngine::create ();
+
+   CHECK (engine);
+
+   bool have_chacha20 = engine->setCipher (HC_CIPHER_CHACHA20);
+
+   HcEngine::destroy (engine);
+
+   if (!have_chacha20)
+   {
+      printf ("   skipped: openssl has no ChaCha20\n");
+      return true;
+   }
+
+   for (HcCipher cipher : { HC_CIPHER_CHACHA20, HC_CIPHER_CHACHA20_POLY1305 })
+   {
+      if (!cipher_round_trips (cipher))
+      {
+         return false;
+      }
+   }
+
+   return tampered_decrypt_fails (HC_CIPHER_CHACHA20_POLY1305);
+}
+
+/*
+   Round trips with io_mode, whole and split, on one thread and several, with a chained and a seekable cipher, for a
+   small file and one of several segments whose size is not a multiple of any page or block.  Files encrypted with
+   io_mode are also decrypted with the default I/O, and the other way around, so both write the same files.
+*/
+static bool io_round_trips (HcIoMode io_mode)
+{
+   for (size_t size : { (size_t) 1000, ((size_t) 5 << 20) + 123 })
+   {
+      for (unsigned long splits : { 0ul, 3ul })
+      {
+         for (unsigned long threads : { 1ul, 4ul })
+         {
+            for (HcCipher cipher : { HC_CIPHER_AES_256_CBC, HC_CIPHER_AES_256_CTR })
+            {
+               // Which of encrypting and decrypting use io_mode.
+               for (int modes : { 3, 1, 2 })
+               {
+                  if (!round_trip ("io", size, (unsigned) (size + splits + threads), splits,
+                                   [=] (HcEngine* engine, bool decrypt)
+                  {
+                     engine->setIoMode ((modes & (decrypt ? 2 : 1)) ? io_mode : HC_IO_DEFAULT);
+                     engine->setCipher (cipher);
+                     engine->setThreads (threads);
+                  }))
+                  {
+                     printf ("   %lu bytes, %lu splits, %lu threads, cipher %d, modes %d\n", (unsigned long) size,
+                             splits, threads, (int) cipher, modes);
+                     return false;
+                  }
+               }
+            }
+         }
+      }
+   }
+
+   return true;
+}
+
+// Mapped files round trip, and are read and written the same as with the default I/O.
+static bool test_mmap_io (void)
+{
+   return io_round_trips (HC_IO_MMAP);
+}
+
+// Files read and written around the cache, in aligned blocks, round trip and are the same as with the default I/O.
+// Where the file system takes no direct I/O, this falls back to the default I/O.
+static bool test_direct_io (void)
+{
+   return io_round_trips (HC_IO_DIRECT);
+}
+
+// Run the command line tool with args, quietly.
+static int run_cli (const std::string& args)
+{
+   return system (("\"" + cli_path + "\" " + args + " > /dev/null 2>&1").c_str ());
+}
+
+/*
+   Batch mode writes the outputs of every file next to it, whatever the current directory, for files given directly
+   and files found by walking directories, including files of the same name in different directories.
+*/
+static bool test_batch_outputs (void)
+{
+   if (cli_path.empty ())
+   {
+      printf ("   skipped: no hypercrypt given\n");
+      return true;
+   }
+
+   const std::vector<std::string> files = { "batch/x", "batch/sub/y", "batch/sub/x", "other/x" };
+   unsigned seed = 11;
+
+   boost::filesystem::create_directories ("batch/sub");
+   boost::filesystem::create_directories ("other");
+
+   for (auto& f : files)
+   {
+      CHECK (write_file (f, 100000 + seed, seed));
+      ++seed;
+   }
+
+   int result = run_cli ("-t 4 -e -b batch other/x");
+
+   for (auto& f : files)
+   {
+      boost::filesystem::rename (f, f + ".keep");
+   }
+
+   if (!result)
+   {
+      result = run_cli ("-t 4 -d -b batch other/x.hckey");
+   }
+
+   bool placed = true;
+
+   for (auto& f : files)
+   {
+      placed = placed && boost::filesystem::exists (f + ".hc") && boost::filesystem::exists (f + ".hckey") &&
+               same_files (f, f + ".keep");
+   }
+
+   bool stray = boost::filesystem::exists ("x") || boost::filesystem::exists ("x.hc") ||
+                boost::filesystem::exists ("y") || boost::filesystem::exists ("y.hc");
+
+   boost::filesystem::remove_all ("batch");
+   boost::filesystem::remove_all ("other");
+
+   CHECK (!result);
+   CHECK (placed);
+   CHECK (!stray);
+
+   return true;
+}
+
+// Get the size of the biggest segment of a key file.
+static unsigned long max_segment_size (const std::string& key_file_name)
+{
+   std::ifstream in (key_file_name, std::ios::binary);
+   std::string xml ((std::istreambuf_iterator<char> (in)), std::istreambuf_iterator<char> ());
+   unsigned long biggest = 0;
+
+   for (size_t pos = xml.find ("<out_size>"); std::string::npos != pos; pos = xml.find ("<out_size>", pos + 1))
+   {
+      biggest = std::max (biggest, strtoul (xml.c_str () + pos + strlen ("<out_size>"), 0, 10));
+   }
+
+   return biggest;
+}
+
+// What the callback of an engine has seen: the segments being done at the same time, and the most there were.
+struct CallbackLog
+{
+   std::atomic<int> m_sections;
+   std::atomic<int> m_most_sections;
+   std::atomic<bool> m_started;
+};
+
+static void log_callback (void* context, HcStatus status, int status_data)
+{
+   CallbackLog& log = *(CallbackLog*) context;
+
+   switch (status)
+   {
+      case HC_STATUS_ENCRYPT_START:
+      case HC_STATUS_DECRYPT_START:
+         log.m_started = true;
+         break;
+
+      case HC_STATUS_ENCRYPT_SECTION_START:
+      case HC_STATUS_DECRYPT_SECTION_START:
+      {
+         int sections = ++log.m_sections;
+
+         if (sections > log.m_most_sections)
+         {
+            log.m_most_sections = sections;
+         }
+
+         // Give the other threads time to start theirs.
+         std::this_thread::sleep_for (std::chrono::milliseconds (20));
+         break;
+      }
+
+      case HC_STATUS_ENCRYPT_SECTION_END:
+      case HC_STATUS_DECRYPT_SECTION_END:
+         --log.m_sections;
+         break;
+
+      default:
+         break;
+   }
+}
+
+/*
+   Within a memory budget, new segments are made smaller, fewer segments are encrypted at the same time, and a key
+   whose segments cannot be decrypted within the budget is turned down before anything is started or written.
+*/
+static bool test_memory_budget (void)
+{
+   const size_t size = 64 << 20;
+
+   CHECK (write_file ("budget", size, 3));
+
+   // Smaller segments with a budget.
+   unsigned long biggest[2];
+
+   for (int i = 0; i < 2; ++i)
+   {
+      HcEngine* engine = HcEngine::create ();
+
+      CHECK (engine);
+      CHECK (engine->setMemoryBudget (i ? 40 : 0));
+      CHECK (HC_STATUS_OK == engine->encryptFile (0, "budget", 0, 0));
+
+      HcEngine::destroy (engine);
+
+      biggest[i] = max_segment_size ("budget.hckey");
+      boost::filesystem::rename ("budget", "budget.keep");
+      remove_files ("budget", 0);
+      boost::filesystem::rename ("budget.keep", "budget");
+   }
+
+   CHECK (biggest[1] < biggest[0]);
+
+   // Fewer segments at a time with a budget.  Four segments of 16 MB on four threads need about 168 MB, and two
+   // threads about 104 MB.
+   int most_sections[2];
+
+   for (int i = 0; i < 2; ++i)
+   {
+      CallbackLog log;
+
+      log.m_sections = 0;
+      log.m_most_sections = 0;
+      log.m_started = false;
+
+      HcEngine* engine = HcEngine::create ();
+
+      CHECK (engine);
+      CHECK (engine->setThreads (4));
+      CHECK (engine->setSegmentSizing (HC_SEGMENT_SIZING_CACHE, 16 << 20));
+      CHECK (engine->setMemoryBudget (i ? 110 : 0));
+      CHECK (HC_STATUS_OK == engine->encryptFile (0, "budget", log_callback, &log));
+
+      HcEngine::destroy (engine);
+
+      most_sections[i] = log.m_most_sections;
+
+      CHECK (16ul << 20 == max_segment_size ("budget.hckey"));
+
+      if (!i)
+      {
+         boost::filesystem::rename ("budget", "budget.keep");
+         remove_files ("budget", 0);
+         boost::filesystem::rename ("budget.keep", "budget");
+      }
+   }
+
+   CHECK (most_sections[0] > 2);
+   CHECK ((most_sections[1] >= 1) && (most_sections[1] <= 2));
+
+   // A budget too small for the 16 MB segments fails before decrypting starts, and writes nothing.
+   boost::filesystem::rename ("budget", "budget.keep");
+
+   CallbackLog log;
+
+   log.m_sections = 0;
+   log.m_most_sections = 0;
+   log.m_started = false;
+
+   HcEngine* engine = HcEngine::create ();
+
+   CHECK (engine);
+   CHECK (engine->setMemoryBudget (20));
+
+   HcStatus status = engine->decryptFile (0, "budget.hckey", log_callback, &log);
+
+   HcEngine::destroy (engine);
+
+   bool written = boost::filesystem::exists ("budget");
+
+   remove_files ("budget", 0);
+   boost::filesystem::remove ("budget.keep");
+
+   CHECK (HC_ERROR_MEMORY_BUDGET_TOO_SMALL == status);
+   CHECK (!log.m_started);
+   CHECK (!written);
+
+   return true;
+}
+
+/*
+   Time encrypting and decrypting a file of megabytes MB on one thread, with the single-level shuffle of version 1 keys
+   and the two-level one of version 2 keys.  The default of 768 MB gives segments of 256 MB, the biggest there are.
+*/
+static int run_benchmark (size_t megabytes)
+{
+   const struct
+   {
+      HcShuffle shuffle;
+      const char* name;
+   }
+   shuffles[] =
+   {
+      { HC_SHUFFLE_LFSR,      "single-level (version 1)" },
+      { HC_SHUFFLE_TWO_LEVEL, "two-level (version 2)" },
+   };
+
+   size_t size = megabytes * 1024 * 1024;
+
+   for (auto& e : shuffles)
+   {
+      typedef std::chrono::steady_clock Clock;
+
+      if (!write_file ("bench", size, 1))
+      {
+         printf ("Cannot write the file!\n");
+         return 1;
+      }
+
+      HcEngine* engine = HcEngine::create ();
+
+      engine->setShuffle (e.shuffle);
+
+      Clock::time_point start = Clock::now ();
+      HcStatus status = engine->encryptFile (0, "bench", 0, 0);
+      Clock::time_point encrypted = Clock::now ();
+
+      boost::filesystem::rename ("bench", "bench.orig");
+
+      if (HC_STATUS_OK == status)
+      {
+         status = engine->decryptFile (0, "bench.hckey", 0, 0);
+      }
+
+      Clock::time_point decrypted = Clock::now ();
+
+      HcEngine::destroy (engine);
+
+      bool same = (HC_STATUS_OK == status) && same_files ("bench", "bench.orig");
+
+      remove_files ("bench", 0);
+
+      if (!same)
+      {
+         printf ("%s: FAILED\n", e.name);
+         return 1;
+      }
+
+      printf ("%s: encrypt %.2f s, decrypt %.2f s\n", e.name,
+              std::chrono::duration<double> (encrypted - start).count (),
+              std::chrono::duration<double> (decrypted - encrypted).count ());
+   }
+
+   return 0;
+}
+
+int main (int argc, char* argv[])
+{
+   struct
+   {
+      const char* name;
+      bool (*run) (void);
+   }
+   tests[] =
+   {
+      { "lfsr skip", test_lfsr_skip },
+      { "lfsr fill", test_lfsr_fill },
+      { "lfsr bank", test_lfsr_bank },
+      { "shuffle permutations", test_shuffle_permutations },
+      { "engine per thread", test_engine_per_thread },
+      { "thread counts", test_thread_counts },
+      { "segment sizing", test_segment_sizing },
+      { "memory budget", test_memory_budget },
+      { "aes ciphers", test_aes_ciphers },
+      { "chacha20 ciphers", test_chacha20_ciphers },
+      { "batch outputs", test_batch_outputs },
+      { "mmap io", test_mmap_io },
+      { "direct io", test_direct_io },
+   };
+
+   bool bench = (argc > 1) && !strcmp (argv[1], "bench");
+
+   if ((argc > 1) && !bench)
+   {
+      cli_path = boost::filesystem::absolute (argv[1]).string ();
+   }
+
+   boost::filesystem::path work_dir = boost::filesystem::temp_directory_path () / boost::filesystem::unique_path ();
+
+   boost::filesystem::create_directories (work_dir);
+   boost::filesystem::current_path (work_dir);
+
+   if (bench)
+   {
+      int result = run_benchmark ((argc > 2) ? (size_t) atol (argv[2]) : 768);
+
+      boost::filesystem::current_path (work_dir.parent_path ());
+      boost::filesystem::remove_all (work_dir);
+
+      return result;
+   }
+
+   for (auto& e : tests)
+   {
+      printf ("%s\n", e.name);
+      e.run ();
+   }
+
+   boost::filesystem::current_path (work_dir.parent_path ());
+   boost::filesystem::remove_all (work_dir);
+
+   printf (failures ? "FAILED\n" : "OK\n");
+
+   return failures ? 1 : 0;
+}